@@ -0,0 +1,82 @@
+import os
+import re
+import json
+import argparse
+import subprocess
+
+# compare the step time and the packing density of films made of the three section shapes. every film is grown with the same seed
+# until the same number of tubes are saved, and the packing density is measured in the fixed height band of input.json, so the
+# numbers of the different shapes are comparable.
+
+section_shapes = ['cylinder', 'capsule', 'multi sphere']
+
+def run_film(executable: str, input_json: dict, directory: str, section_shape: str):
+  '''
+  Run the simulation for one section shape and read the metrics from its output
+
+  Parameters:
+    executable (str): path to the compiled simulation
+    input_json (dict): input properties shared by all the section shapes
+    directory (str): directory in which the film of each section shape gets its own output directory
+    section_shape (str): section shape of the film
+
+  Returns:
+    (step_time, packing_density, height): mean step time in ms, packing density in the height band, and height of the film in nm
+  '''
+  j = dict(input_json)
+  j['section shape'] = section_shape
+  j['output directory'] = os.path.join(directory, section_shape.replace(' ', '_'))
+  j['keep old files'] = False
+
+  filename = os.path.join(directory, f"input.{section_shape.replace(' ', '_')}.json")
+  with open(filename, 'w') as file:
+    json.dump(j, file, indent=4)
+
+  print(f'running the film with {section_shape} sections: {filename}')
+  output = subprocess.run([executable, filename], stdout=subprocess.PIPE, universal_newlines=True, check=True).stdout
+
+  number = r'([-+0-9.eE]+|nan|inf)'
+  step_time = float(re.findall(r'mean step time \[ms\]: ' + number, output)[-1])
+  packing_density = float(re.findall(r'packing density: ' + number, output)[-1])
+  heights = re.findall(r'height \[nm\]:' + number, output)
+  height = float(heights[-1]) if heights else 0
+  return step_time, packing_density, height
+
+def main():
+  parser = argparse.ArgumentParser()
+  parser.add_argument('--executable', help='Path to the compiled simulation', default='./main.exe')
+  parser.add_argument('--input', help='Input file whose properties are used for all the section shapes', default='input.json')
+  parser.add_argument('--directory', help='Directory for the outputs of the films', default='~/research/mesh/section_shape_benchmark')
+  parser.add_argument('--seed', help='Random seed of all the films', type=int, default=1)
+  parser.add_argument('--tubes', help='Number of saved tubes at which the films stop', type=int, default=500)
+
+  args = parser.parse_args()
+
+  with open(args.input) as file:
+    input_json = json.load(file)
+
+  # every film runs alone in one headless process until it has the same number of saved tubes
+  input_json['random seed'] = args.seed
+  input_json['target number of saved tubes'] = args.tubes
+  input_json['target film height [nm]'] = 0
+  input_json['wall clock budget [s]'] = 0
+  input_json['checkpoint interval [s]'] = 0
+  input_json['ensemble size'] = 1
+  input_json['headless'] = True
+  input_json['visualize'] = False
+
+  directory = os.path.expanduser(args.directory)
+  os.makedirs(directory, exist_ok=True)
+
+  band = input_json['packing density band [nm]']
+  results = {shape: run_film(args.executable, input_json, directory, shape) for shape in section_shapes}
+
+  print(f'\nseed: {args.seed},  saved tubes: {args.tubes},  packing density band [nm]: {band}')
+  print(f"{'section shape':>15} {'step time [ms]':>15} {'packing density':>16} {'height [nm]':>12}")
+  for shape, (step_time, packing_density, height) in results.items():
+    print(f'{shape:>15} {step_time:>15.3f} {packing_density:>16.4f} {height:>12.1f}')
+    if height < band[1]:
+      print(f'  warning: the film with {shape} sections does not reach the top of the packing density band, so its density is too low!!!')
+
+if __name__ == '__main__':
+  main()
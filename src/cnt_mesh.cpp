@@ -7,20 +7,49 @@
 #include <experimental/filesystem>
 #include <fstream>
 #include <cstddef>
+#include <algorithm>
+#include <limits>
+#include <chrono>
+#include <sstream>
+#include <iterator>
+#include <unordered_map>
 
 #include "../lib/json.hpp"
 #include "./helper/prepare_directory.hpp"
 #include "cnt_mesh.h"
+#include "uniform_grid_broadphase.h"
 
 #include "btBulletDynamicsCommon.h"
 #include "LinearMath/btVector3.h"
 #include "LinearMath/btAlignedObjectArray.h" 
+#include "LinearMath/btThreads.h"
+#include "BulletDynamics/Dynamics/btDiscreteDynamicsWorldMt.h"
+#include "BulletCollision/CollisionDispatch/btCollisionDispatcherMt.h"
+#include "BulletDynamics/Featherstone/btMultiBodyConstraintSolver.h"
+#include "BulletDynamics/Featherstone/btMultiBodyLinkCollider.h"
+#include "BulletDynamics/Featherstone/btMultiBodySphericalJointLimit.h"
 #include "../misc_files/CommonInterfaces/CommonRigidBodyBase.h"
+#include "../misc_files/CommonInterfaces/CommonRenderInterface.h"
 
 void cnt_mesh::initPhysics() {
   m_guiHelper->setUpAxis(1);
 
   createEmptyDynamicsWorld();
+
+  // time that a body has to stay below its sleeping thresholds before its island can go to sleep. this is a global in bullet that is
+  // read by every world that is stepping, so it is set once by main or run_ensemble before any film starts, and a film with another
+  // deactivation time is rejected.
+  if (gDeactivationTime != _deactivation_time) {
+    throw std::invalid_argument("the deactivation time of the film is " + std::to_string(_deactivation_time) + " [s], but bullet is set to "
+                                + std::to_string(gDeactivationTime) + " [s] for all the films of the process.");
+  }
+
+  // dynamic sections collide with everything, frozen sections only collide with dynamic ones, and neighbor sections of the same tube
+  // do not collide at all
+  m_dynamicsWorld->getPairCache()->setOverlapFilterCallback(&_section_filter);
+
+  // only update the aabb of active objects. frozen tubes are static and sleeping, so they do not cost anything per step.
+  m_dynamicsWorld->setForceUpdateAllAabbs(false);
   
   m_guiHelper->createPhysicsDebugDrawer(m_dynamicsWorld);
 
@@ -28,10 +57,138 @@ void cnt_mesh::initPhysics() {
     m_dynamicsWorld->getDebugDrawer()->setDebugMode(btIDebugDraw::DBG_DrawWireframe+btIDebugDraw::DBG_DrawContactPoints);
 }
 
+// create the dynamics world. the multithreaded world solves the simulation islands (i.e. the separate groups of
+// touching tubes) in parallel with a pool of constraint solvers, and runs the narrowphase in parallel.
+// both worlds are wrapped in batch_world so that whole batches of tubes can be detached at once.
+void cnt_mesh::createEmptyDynamicsWorld() {
+  btITaskScheduler* scheduler = nullptr;
+  if (_multithreaded) {
+    // the task scheduler is shared by the whole process, so only create it once.
+    static btITaskScheduler* default_scheduler = btCreateDefaultTaskScheduler();
+    scheduler = default_scheduler;
+    if (scheduler == nullptr)
+      std::cout << "warning: bullet is not compiled with BT_THREADSAFE=1, using the single threaded dynamics world!!!" << std::endl;
+  }
+
+  if (_multibody) {
+    // same as CommonMultiBodyBase::createEmptyDynamicsWorld, without the overlap filter of the examples
+    m_collisionConfiguration = new btDefaultCollisionConfiguration();
+    m_dispatcher = new btCollisionDispatcher(m_collisionConfiguration);
+    m_broadphase = create_broadphase();
+    btMultiBodyConstraintSolver* solver = new btMultiBodyConstraintSolver;
+    m_solver = solver;
+
+    auto world = new batch_world<timed_world<btMultiBodyDynamicsWorld>>(m_dispatcher, m_broadphase, solver, m_collisionConfiguration);
+    m_dynamicsWorld = world;
+    _multibody_world = world;
+    _batch_world = world;
+    _broadphase_timer = world;
+    _step_clock = world;
+
+    m_dynamicsWorld->setGravity(btVector3(0, -10, 0));
+    return;
+  }
+
+  if (scheduler == nullptr) {
+    // same as CommonRigidBodyBase::createEmptyDynamicsWorld
+    m_collisionConfiguration = new btDefaultCollisionConfiguration();
+    m_dispatcher = new btCollisionDispatcher(m_collisionConfiguration);
+    m_broadphase = create_broadphase();
+    m_solver = new btSequentialImpulseConstraintSolver;
+
+    auto world = new batch_world<timed_world<btDiscreteDynamicsWorld>>(m_dispatcher, m_broadphase, m_solver, m_collisionConfiguration);
+    m_dynamicsWorld = world;
+    _batch_world = world;
+    _broadphase_timer = world;
+    _step_clock = world;
+
+    m_dynamicsWorld->setGravity(btVector3(0, -10, 0));
+    return;
+  }
+  scheduler->setNumThreads(_number_of_threads);
+  btSetTaskScheduler(scheduler);
+  std::cout << "multithreaded dynamics world with " << scheduler->getNumThreads() << " threads" << std::endl;
+
+  // the parallel dispatcher needs larger pools, otherwise it falls back to the heap from several threads at the same time
+  btDefaultCollisionConstructionInfo cci;
+  cci.m_defaultMaxPersistentManifoldPoolSize = 80000;
+  cci.m_defaultMaxCollisionAlgorithmPoolSize = 80000;
+  m_collisionConfiguration = new btDefaultCollisionConfiguration(cci);
+
+  m_dispatcher = new btCollisionDispatcherMt(m_collisionConfiguration, 40);
+
+  m_broadphase = create_broadphase();
+
+  // one btSequentialImpulseConstraintSolver per thread
+  btConstraintSolverPoolMt* solver_pool = new btConstraintSolverPoolMt(scheduler->getNumThreads());
+  m_solver = solver_pool;
+
+  auto world = new batch_world<timed_world<btDiscreteDynamicsWorldMt>>(m_dispatcher, m_broadphase, solver_pool, nullptr, m_collisionConfiguration);
+  m_dynamicsWorld = world;
+  _batch_world = world;
+  _broadphase_timer = world;
+  _step_clock = world;
+
+  m_dynamicsWorld->setGravity(btVector3(0, -10, 0));
+}
+
+// create the broadphase. the axis sweep broadphases need fixed bounds, which are the container walls in x and z (plus one section
+// length for the tubes that stick out) and the ground to _broadphase_height in y. the objects outside of the bounds are still
+// handled, but they are all squeezed into the last bucket and lose the benefit of sorting. the number of handles of the axis sweep
+// broadphases is fixed too, and is set to the largest number of objects that can be in the world, which is checked in
+// parse_json_prop. the axis sweeps are wrapped in batch_axis_sweep, so batch_world can remove a batch of their proxies in one pass.
+btBroadphaseInterface* cnt_mesh::create_broadphase() {
+  float margin = _section_length.back();
+  btVector3 world_min(-_half_Lx-margin, -margin, -_half_Lz-margin);
+  btVector3 world_max(_half_Lx+margin, _broadphase_height, _half_Lz+margin);
+
+  std::cout << "broadphase: " << _broadphase_type << std::endl;
+
+  if (_broadphase_type == "axis sweep")
+    return new batch_axis_sweep<btAxisSweep3>(world_min, world_max, (unsigned short)(_max_number_of_objects));
+  if (_broadphase_type == "32 bit axis sweep")
+    return new batch_axis_sweep<bt32BitAxisSweep3>(world_min, world_max, (unsigned int)(_max_number_of_objects));
+  if (_broadphase_type == "uniform grid")
+    return new uniform_grid_broadphase(_grid_cell_size);
+  return new btDbvtBroadphase();
+}
+
+// upper bound of the number of collision objects in the world, or -1 if there is no bound. the tubes that are ever added are bounded by
+// the target number of saved tubes plus the active and unsaved ones. with merging, at most the active, the unsaved and one block
+// worth of frozen tubes (and a batch of new ones) are in the world as separate sections, and the rest are in the static blocks.
+// each section of a periodic cell can have up to three images, and the ground plane, the floor and its images are added on top.
+long long cnt_mesh::max_number_of_objects() {
+  long long target = _json_prop["target number of saved tubes"];
+  if (target <= 0)
+    return -1;
+
+  long long active = _json_prop["number of active tubes"];
+  long long unsaved = _json_prop["number of unsaved tubes"];
+  long long batch = _json_prop["number of tubes added together"];
+  long long tubes_per_block = _json_prop["number of tubes per static block"];
+
+  long long total_tubes = target + active + unsaved + batch;
+  long long tubes_in_world = total_tubes;
+  long long blocks = 0;
+  if (tubes_per_block > 0) {
+    tubes_in_world = std::min(total_tubes, active + unsaved + tubes_per_block + batch);
+    blocks = total_tubes/tubes_per_block + 1;
+  }
+
+  // sections are added to a tube until their total length reaches the length of the tube
+  long long sections_per_tube = (long long)(std::ceil(_tube_length.back()/_section_length.front())) + 1;
+  long long sections = tubes_in_world*sections_per_tube;
+  if (_periodic)
+    sections *= 4;
+
+  return sections + blocks + 10;
+}
+
 // create a rectangular container using half planes
 void cnt_mesh::create_container(){
 
   Ly = 0.;
+  _surface_height = 0.;
 
   // create a few basic rigid bodies
   //**********************************************************************************************
@@ -46,7 +203,8 @@ void cnt_mesh::create_container(){
     groundTransform.setOrigin(btVector3(0,0,0)); 
   
     btScalar mass(0.);
-    createRigidBody(mass,groundTransform,groundShape, btVector4(0,0,1,1)); // I think the last input is not used for anything. On paper it is supposed to be the collor
+    btRigidBody* ground = createRigidBody(mass,groundTransform,groundShape, btVector4(0,0,1,1)); // I think the last input is not used for anything. On paper it is supposed to be the collor
+    create_graphics_object(ground, btVector4(1,1,1,1));
   }
 
   // // create the z direction side wall planes
@@ -99,97 +257,755 @@ void cnt_mesh::create_container(){
   // 	groundTransform.setOrigin(btVector3(_half_Lx,0,0));	
   // 	createRigidBody(mass,groundTransform,groundShape, btVector4(0,0,1,1)); // I think the last input is not used for anything. On paper it is supposed to be the collor
   // }
-  
-  m_guiHelper->autogenerateGraphicsObjects(m_dynamicsWorld);
 }
 
-// make tubes static in the simulation and only leave number_of_active_tubes as dynamic in the simulation.
+// make tubes static in the simulation. with the depth policy, the tubes whose top is _freeze_depth below the settled surface (which
+// includes the dynamic tubes at rest), and the tubes that have been sleeping for _freeze_sleeping_steps are frozen first. then the oldest dynamic tubes are frozen until only
+// number_of_active_tubes are left, which is all that the count policy does.
 void cnt_mesh::freeze_tubes(unsigned number_of_active_tubes) {
-  if (tubes.size() <= number_of_active_tubes)
-    return;
-  
-  auto it = std::prev(tubes.end(),number_of_active_tubes+1);
+  std::vector<int> slots;
+
+  if ((_freeze_policy == "depth") or (_freeze_policy == "sleeping")) {
+    bool check_depth = (_freeze_policy == "depth");
+    for (int slot=_first_dynamic; slot<int(tubes.size()); ++slot) {
+      tube& t = tubes[slot];
+      if (not t.isDynamic)
+        continue;
+      if ((t.sleeping_steps >= _freeze_sleeping_steps) or (check_depth and (tube_top(t) < _settled_surface_height-_freeze_depth)))
+        slots.push_back(slot);
+    }
+    freeze_batch(slots);
+    slots.clear();
+  }
 
-  while(it->isDynamic){
-      // make the sections static by putting their mass equal to zero
-      for(auto& b: it->bodies){
-        b->setMassProps(0,btVector3(0,0,0));
-      }
+  int number_of_dynamic_tubes = _number_of_dynamic_tubes;
+  for (int slot=_first_dynamic; (slot<int(tubes.size())) and (number_of_dynamic_tubes > int(number_of_active_tubes)); ++slot) {
+    if (tubes[slot].isDynamic) {
+      slots.push_back(slot);
+      number_of_dynamic_tubes--;
+    }
+  }
+  freeze_batch(slots);
+
+  while ((_first_dynamic < int(tubes.size())) and (not tubes[_first_dynamic].isDynamic)) {
+    _first_dynamic++;
+  }
+}
+
+// highest point of the aabbs of the sections of a tube
+float cnt_mesh::tube_top(const tube& t) {
+  btVector3 aabb_min, aabb_max;
+  float top = 0;
+  for (int i=t.first_section; i<t.first_section+t.number_of_sections; ++i) {
+    _section_bodies[i]->getCollisionShape()->getAabb(_section_bodies[i]->getWorldTransform(), aabb_min, aabb_max);
+    top = std::max(top, float(aabb_max.y()));
+  }
+  return top;
+}
+
+// add the part of the volume of a frozen section that is inside the height band of the packing density. the volume is split in
+// proportion to the height of the aabb of the section that is inside the band.
+void cnt_mesh::add_to_density_band(const btCollisionObject* obj, float volume) {
+  btVector3 aabb_min, aabb_max;
+  obj->getCollisionShape()->getAabb(obj->getWorldTransform(), aabb_min, aabb_max);
+  float overlap = std::min(float(aabb_max.y()), _density_band_top) - std::max(float(aabb_min.y()), _density_band_bottom);
+  if (overlap > 0)
+    _density_band_volume += volume*overlap/(aabb_max.y()-aabb_min.y());
+}
+
+// the tube is at rest when it is sleeping or when all of its sections are slower than the linear sleeping threshold. the velocities of
+// the links of a multibody are only available in the local frames of the links, which is enough for their magnitude.
+bool cnt_mesh::tube_at_rest(const tube& t) {
+  if (t.sleeping_steps > 0)
+    return true;
+
+  btScalar threshold2 = _linear_sleeping_threshold*_linear_sleeping_threshold;
+  if (t.multibody) {
+    btAlignedObjectArray<btVector3> link_omega, link_velocity;
+    link_omega.resize(t.number_of_sections);
+    link_velocity.resize(t.number_of_sections);
+    t.multibody->compTreeLinkVelocities(&link_omega[0], &link_velocity[0]);
+    for (int k=0; k<t.number_of_sections; ++k) {
+      if (link_velocity[k].length2() > threshold2)
+        return false;
+    }
+    return true;
+  }
+
+  for (int i=t.first_section; i<t.first_section+t.number_of_sections; ++i) {
+    if (btRigidBody::upcast(_section_bodies[i])->getLinearVelocity().length2() > threshold2)
+      return false;
+  }
+  return true;
+}
+
+// remove a set of constraints and collision objects from the world. the constraints go first, because the bodies keep references to them.
+void cnt_mesh::detach_from_world(const std::vector<btTypedConstraint*>& constraints, const std::vector<btCollisionObject*>& objects) {
+  _batch_world->remove_constraints(constraints);
+  _batch_world->remove_collision_objects(objects);
+}
+
+// make the sections of the tubes in the given slots static and delete the constraints between them. all the sections are detached
+// from the world in one batch and added back as static bodies, so that they leave the list of non-static rigid bodies (which is
+// integrated and checked for sleeping every step) and get a static broadphase proxy. the link colliders of multibody tubes are
+// replaced by static rigid bodies at the same place.
+void cnt_mesh::freeze_batch(const std::vector<int>& slots) {
+  std::vector<btTypedConstraint*> constraints;
+  std::vector<btCollisionObject*> objects;
+  std::vector<int> frozen_slots;
+
+  for (int slot: slots) {
+    tube& t = tubes[slot];
+    if (not t.isDynamic)
+      continue;
+    if (t.multibody)
+      detach_multibody(t);
+    for (int i=t.first_section; i<t.first_section+t.number_of_sections; ++i) {
+      if (_section_constraints[i])
+        constraints.push_back(_section_constraints[i]);
+      _section_constraints[i] = nullptr;
+      objects.push_back(_section_bodies[i]);
+    }
+    t.isDynamic = false;
+    _number_of_dynamic_tubes--;
+    frozen_slots.push_back(slot);
+  }
+
+  detach_from_world(constraints, objects);
+
+  for (auto& c: constraints) {
+    _constraint_pool.destroy(static_cast<btConeTwistConstraint*>(c));
+  }
 
-      //delete constraints between the tube sections
-      for (auto& c: it->constraints) {
-        m_dynamicsWorld->removeConstraint(c);
-        delete c;
-        c = nullptr;
+  for (int slot: frozen_slots) {
+    tube& t = tubes[slot];
+    for (int i=t.first_section; i<t.first_section+t.number_of_sections; ++i) {
+      if (t.multibody) {
+        btCollisionObject* col = _section_bodies[i];
+        btRigidBody* b = create_section_body(0, col->getWorldTransform(), col->getCollisionShape(), t.id, i-t.first_section); // static bodies are put to sleep when they are added
+        create_graphics_object(b);
+        _section_bodies[i] = b;
+        m_guiHelper->removeGraphicsInstance(col->getUserIndex());
+        delete col;
+      } else {
+        btRigidBody* b = btRigidBody::upcast(_section_bodies[i]);
+        make_static(b);
+        m_dynamicsWorld->addRigidBody(b, COL_FROZEN, COL_TUBE); // static bodies go into the static broadphase tree
       }
+      add_to_height_map(_surface, _section_bodies[i]->getWorldTransform(), _section_bodies[i]->getCollisionShape());
+      _deposited_volume += section_volume(t.diameter, _body_length[i]);
+      add_to_density_band(_section_bodies[i], section_volume(t.diameter, _body_length[i]));
+    }
+    if (t.multibody)
+      delete_multibody(t); // only the multibody itself is left, the link colliders are already replaced
+    add_ghosts(t);
+  }
+
+  // with the sleeping policy the tubes that have been sleeping long enough are saved right when they freeze, so their saved
+  // coordinates are the ones of settled tubes. the tubes that are frozen by the cap on the number of active tubes have not settled,
+  // so they are left to save_tubes like with the other policies.
+  if (_freeze_policy == "sleeping") {
+    for (int slot: frozen_slots) {
+      if (tubes[slot].sleeping_steps < _freeze_sleeping_steps)
+        continue;
+      save_one_tube(tubes[slot]);
+      tubes[slot].isSaved = true;
+    }
+  }
+}
+
+// delete the bodies and the remaining constraints of the tubes in the given slots and mark them as removed. the objects are detached
+// from the world in one batch, and the bodies and their motion states go back to the pools.
+void cnt_mesh::release_batch(const std::vector<int>& slots) {
+  std::vector<btTypedConstraint*> constraints;
+  std::vector<btCollisionObject*> objects;
+  std::vector<int> multibody_slots;
+
+  for (int slot: slots) {
+    tube& t = tubes[slot];
+    if (t.isRemoved)
+      continue;
+    if (t.multibody) {
+      detach_multibody(t);
+      multibody_slots.push_back(slot);
+    }
+    for (int i=t.first_section; i<t.first_section+t.number_of_sections; ++i) {
+      if (_section_constraints[i])
+        constraints.push_back(_section_constraints[i]);
+      _section_constraints[i] = nullptr;
+      objects.push_back(_section_bodies[i]);
+    }
+    objects.insert(objects.end(), t.ghosts.begin(), t.ghosts.end());
+    if (t.isDynamic)
+      _number_of_dynamic_tubes--;
+    t.isDynamic = false;
+    t.isRemoved = true;
+  }
+
+  detach_from_world(constraints, objects);
+
+  for (auto& c: constraints) {
+    _constraint_pool.destroy(static_cast<btConeTwistConstraint*>(c));
+  }
+
+  // the link colliders of the dynamic multibody tubes are not pooled
+  for (int slot: multibody_slots) {
+    delete_multibody(tubes[slot]);
+  }
+
+  std::vector<btRigidBody*> bodies;
+  bodies.reserve(objects.size());
+  for (int slot: slots) {
+    tube& t = tubes[slot];
+    for (int i=t.first_section; i<t.first_section+t.number_of_sections; ++i) {
+      if (_section_bodies[i] == nullptr)
+        continue;
+      btRigidBody* b = btRigidBody::upcast(_section_bodies[i]);
+      m_guiHelper->removeGraphicsInstance(b->getUserIndex());
+      _motion_state_pool.destroy(static_cast<btDefaultMotionState*>(b->getMotionState()));
+      bodies.push_back(b);
+      _section_bodies[i] = nullptr;
+    }
+    for (auto& ghost: t.ghosts) {
+      m_guiHelper->removeGraphicsInstance(ghost->getUserIndex());
+      _motion_state_pool.destroy(static_cast<btDefaultMotionState*>(ghost->getMotionState()));
+      bodies.push_back(ghost);
+    }
+    t.ghosts.clear();
+  }
+  _body_pool.destroy(bodies.begin(), bodies.end());
+}
+
+// create the sections of a tube as the base and the links of a btMultiBody. the sections are joined by spherical joints at their ends,
+// so the tube only has the degrees of freedom of the joints instead of six per section, and the joints can not drift apart.
+// the swing of the joints is limited by btMultiBodySphericalJointLimit.
+void cnt_mesh::create_multibody_tube(tube& t, const std::vector<btTransform>& transforms, const std::vector<btCollisionShape*>& shapes, const std::vector<btScalar>& masses) {
+  const float pi = 3.14159265358979323846;
+  const btScalar max_applied_impulse = 100; // maximum impulse of a joint limit in one step
+
+  int number_of_links = int(transforms.size())-1;
+
+  btVector3 inertia(0,0,0);
+  shapes[0]->calculateLocalInertia(masses[0], inertia);
+  btMultiBody* mb = new btMultiBody(number_of_links, masses[0], inertia, false /*fixed base*/, true /*can sleep*/);
+  mb->setHasSelfCollision(true); // sections of the same tube that are not neighbors can collide
+  // a multibody sleeps when the sum of the squares of its velocities stays below the threshold for the timeout
+  mb->setSleepThreshold(_linear_sleeping_threshold*_linear_sleeping_threshold);
+  mb->setSleepTimeout(_deactivation_time);
+  mb->setBasePos(transforms[0].getOrigin());
+  mb->setWorldToBaseRot(transforms[0].getRotation().inverse());
+
+  // link k is the section k+1 of the tube. the pivot of the joint is at the end of the parent section, and all the sections
+  // start with the same orientation.
+  for (int k=0; k<number_of_links; ++k) {
+    int i = t.first_section+k;
+    shapes[k+1]->calculateLocalInertia(masses[k+1], inertia);
+    mb->setupSpherical(k, masses[k+1], inertia, k-1, btQuaternion(0,0,0,1), btVector3(0,_body_length[i]/2,0), btVector3(0,_body_length[i+1]/2,0), true /*disable collision with parent*/);
+  }
+  mb->finalizeMultiDof();
+  _multibody_world->addMultiBody(mb);
+
+  for (int k=-1; k<number_of_links; ++k) {
+    btMultiBodyLinkCollider* col = new btMultiBodyLinkCollider(mb, k);
+    col->setCollisionShape(shapes[k+1]);
+    col->setWorldTransform(transforms[k+1]);
+    col->setUserIndex2(t.id);
+    col->setUserIndex3(k+1);
+    if (k == -1) {
+      mb->setBaseCollider(col);
+    } else {
+      mb->getLink(k).m_collider = col;
+    }
+    _multibody_world->addCollisionObject(col, COL_TUBE, COL_EVERYTHING);
+    _section_bodies[t.first_section+k+1] = col;
+  }
+
+  for (int k=0; k<number_of_links; ++k) {
+    btMultiBodySphericalJointLimit* limit = new btMultiBodySphericalJointLimit(mb, k, _multibody_swing_limit, _multibody_swing_limit, pi/2, max_applied_impulse);
+    limit->finalizeMultiDof();
+    _multibody_world->addMultiBodyConstraint(limit);
+    _section_joint_limits[t.first_section+k] = limit;
+  }
+
+  t.multibody = mb;
+}
+
+// remove the joint limits and the multibody of a tube from the world. there are only a few dynamic tubes, so the linear search in
+// the multibody arrays of the world is cheap. the link colliders are detached together with the other sections of the batch.
+void cnt_mesh::detach_multibody(tube& t) {
+  for (int i=t.first_section; i<t.first_section+t.number_of_sections; ++i) {
+    btMultiBodyConstraint*& limit = _section_joint_limits[i];
+    if (limit) {
+      _multibody_world->removeMultiBodyConstraint(limit);
+      delete limit;
+      limit = nullptr;
+    }
+  }
+  _multibody_world->removeMultiBody(t.multibody);
+}
+
+// delete the multibody of a tube and the link colliders that are still in the section array
+void cnt_mesh::delete_multibody(tube& t) {
+  for (int i=t.first_section; i<t.first_section+t.number_of_sections; ++i) {
+    btMultiBodyLinkCollider* col = btMultiBodyLinkCollider::upcast(_section_bodies[i]);
+    if (col) {
+      m_guiHelper->removeGraphicsInstance(col->getUserIndex());
+      delete col;
+      _section_bodies[i] = nullptr;
+    }
+  }
+  delete t.multibody;
+  t.multibody = nullptr;
+}
 
-      it->constraints.clear();
-      it->isDynamic = false;
+// create a rigid body for a tube section. this does the same thing as createRigidBody, but the body and its motion state come
+// from the pools instead of the heap.
+btRigidBody* cnt_mesh::create_section_body(btScalar mass, const btTransform& startTransform, btCollisionShape* shape, int tube_id, int section_index) {
+  btVector3 localInertia(0,0,0);
+  if (mass != 0.f)
+    shape->calculateLocalInertia(mass, localInertia);
+
+  btDefaultMotionState* motion_state = _motion_state_pool.create(startTransform);
+  btRigidBody::btRigidBodyConstructionInfo cInfo(mass, motion_state, shape, localInertia);
+  btRigidBody* body = _body_pool.create(cInfo);
+
+  body->setUserIndex(-1);
+  body->setSleepingThresholds(_linear_sleeping_threshold, _angular_sleeping_threshold);
+  // the tube and section numbers have to be set before the body is added, because the broadphase makes its pairs right away
+  body->setUserIndex2(tube_id);
+  body->setUserIndex3(section_index);
+  if (mass != 0.f) {
+    m_dynamicsWorld->addRigidBody(body, COL_TUBE, COL_EVERYTHING);
+  } else {
+    m_dynamicsWorld->addRigidBody(body, COL_FROZEN, COL_TUBE);
+  }
+  return body;
+}
 
-      if (it==tubes.begin())
-        break;
-      else
-        --it;
+// the tube sections are not allocated with new, so they are destroyed here before CommonRigidBodyBase deletes the rest of the objects
+void cnt_mesh::exitPhysics() {
+  if (m_dynamicsWorld) {
+    std::vector<int> slots;
+    for (int slot=_first_tube; slot<int(tubes.size()); ++slot) {
+      slots.push_back(slot);
+    }
+    release_batch(slots);
   }
 
+  CommonRigidBodyBase::exitPhysics();
+  _batch_world = nullptr;
+  _multibody_world = nullptr;
+  _broadphase_timer = nullptr;
+  _step_clock = nullptr;
+}
 
-  // int n = tubes.size() - number_of_active_tubes;
+// move _first_tube past the removed tubes. when the removed tubes take more than half of the storage, they are dropped from the
+// front of the tube and section arrays and the slots of the remaining tubes are shifted. this is amortized O(1) per tube.
+void cnt_mesh::advance_first_tube() {
+  while ((_first_tube < int(tubes.size())) and tubes[_first_tube].isRemoved) {
+    _first_tube++;
+  }
 
-  // int i=0;
-  // for (auto& t: tubes) {
-  //   if (t.isDynamic) {
-      
-  //     //make the sections static by putting their mass equal to zero
-  //     for(auto& b: t.bodies){
-  //       b->setMassProps(0,btVector3(0,0,0));
-  //     }
+  if ((_first_tube < 1024) or (2*_first_tube < int(tubes.size())))
+    return;
 
-  //     //delete constraints between the tube sections
-  //     for (auto& c: t.constraints) {
-  //       m_dynamicsWorld->removeConstraint(c);
-  //       delete c;
-  //       c = nullptr;
-  //     }
+  int first_section = (_first_tube < int(tubes.size())) ? tubes[_first_tube].first_section : int(_section_bodies.size());
 
-  //     t.constraints.clear();
-  //     t.isDynamic = false;
+  tubes.erase(tubes.begin(), tubes.begin()+_first_tube);
+  _section_bodies.erase(_section_bodies.begin(), _section_bodies.begin()+first_section);
+  _body_length.erase(_body_length.begin(), _body_length.begin()+first_section);
+  _section_constraints.erase(_section_constraints.begin(), _section_constraints.begin()+first_section);
+  _section_joint_limits.erase(_section_joint_limits.begin(), _section_joint_limits.begin()+first_section);
 
-  //     i++;
-  //   }
+  for (auto& t: tubes) {
+    t.first_section -= first_section;
+  }
+  _first_dynamic = std::max(0, _first_dynamic-_first_tube);
+  _first_unsaved = std::max(0, _first_unsaved-_first_tube);
+  _first_tube = 0;
+}
 
-  //   if (i>=n)
-  //     break;
-  // }
+// convert a dynamic body into a static one. the body has to be detached from the world while its flags change.
+void cnt_mesh::make_static(btRigidBody* b) {
+  b->setMassProps(0,btVector3(0,0,0));
+  b->setLinearVelocity(btVector3(0,0,0));
+  b->setAngularVelocity(btVector3(0,0,0));
+  b->setCollisionFlags(b->getCollisionFlags() | btCollisionObject::CF_STATIC_OBJECT);
+  b->forceActivationState(ISLAND_SLEEPING); // static objects that are not active never get their aabb updated
 }
 
-// remove the tubes from the simulation and only leave max_number_of_tubes in the simulation
+// remove the tubes from the simulation and only leave max_number_of_tubes in the simulation. only the frozen tubes are removed.
 void cnt_mesh::remove_tubes(unsigned max_number_of_tubes) {
-  if (tubes.size()<=max_number_of_tubes)
+  std::vector<int> slots;
+  for (int slot=_first_tube; (slot < _first_dynamic) and (int(tubes.size())-slot > int(max_number_of_tubes)); ++slot) {
+    slots.push_back(slot);
+  }
+  release_batch(slots);
+  advance_first_tube();
+}
+
+// merge the oldest frozen and saved tubes into one static compound body and release their individual rigid bodies.
+// the child shapes are the shared section collision shapes placed at the final section transforms, so the geometry
+// does not change. this keeps the number of broadphase proxies small for very deep films.
+void cnt_mesh::merge_tubes(unsigned number_of_tubes_per_block) {
+  if (number_of_tubes_per_block == 0)
     return;
-  
-  int n = tubes.size() - max_number_of_tubes;
-
-  while (tubes.size() > max_number_of_tubes) {
-    tube& my_tube = tubes.front();
-    if (! my_tube.isDynamic) {				
-      for (auto& b: my_tube.bodies) {
-        deleteRigidBody(b);
-        b = nullptr;
+
+  // only tubes that are frozen and whose coordinates are already written to the output files can be merged
+  int last = std::min(_first_dynamic, _first_unsaved);
+  if (last-_first_tube < int(number_of_tubes_per_block))
+    return;
+
+  btCompoundShape* block_shape = new btCompoundShape(true);
+  m_collisionShapes.push_back(block_shape);
+
+  std::vector<int> slots;
+  for (int slot=_first_tube; slot<_first_tube+int(number_of_tubes_per_block); ++slot) {
+    tube& my_tube = tubes[slot];
+    if (my_tube.isRemoved)
+      continue;
+    for (int i=my_tube.first_section; i<my_tube.first_section+my_tube.number_of_sections; ++i) {
+      btCollisionObject* b = _section_bodies[i];
+      block_shape->addChildShape(b->getWorldTransform(), b->getCollisionShape());
+    }
+    for (auto& ghost: my_tube.ghosts) {
+      block_shape->addChildShape(ghost->getWorldTransform(), ghost->getCollisionShape());
+    }
+    slots.push_back(slot);
+  }
+  release_batch(slots);
+  advance_first_tube();
+
+  add_static_block(block_shape);
+}
+
+// add a static body with the compound shape of a block of merged tubes. the child transforms are in world coordinates.
+void cnt_mesh::add_static_block(btCompoundShape* block_shape) {
+  btTransform block_transform;
+  block_transform.setIdentity();
+  btRigidBody* block = createRigidBody(0, block_transform, block_shape);
+  block->forceActivationState(ISLAND_SLEEPING);
+  create_graphics_object(block);
+
+  _static_blocks.push_back(block);
+}
+
+// in conveyor mode remove the frozen and saved tubes and static blocks that are entirely below the band of tubes that is kept in the
+// world, and replace them with a static heightfield that follows the top of the removed tubes. this way the number of objects in the
+// world does not grow with the number of deposited tubes.
+void cnt_mesh::convey_tubes() {
+  if (not _conveyor)
+    return;
+
+  float bottom_of_band = Ly - _conveyor_band_depth;
+  if (bottom_of_band <= 0)
+    return;
+
+  bool floor_changed = false;
+  btVector3 aabb_min, aabb_max;
+
+  // only tubes that are frozen and whose coordinates are already saved can be removed
+  int last = std::min(_first_dynamic, _first_unsaved);
+  std::vector<int> slots;
+  for (int slot=_first_tube; slot<last; ++slot) {
+    tube& my_tube = tubes[slot];
+    if (my_tube.isRemoved)
+      continue;
+
+    if (tube_top(my_tube) >= bottom_of_band)
+      continue;
+
+    for (int i=my_tube.first_section; i<my_tube.first_section+my_tube.number_of_sections; ++i) {
+      add_to_height_map(_floor, _section_bodies[i]->getWorldTransform(), _section_bodies[i]->getCollisionShape());
+    }
+    slots.push_back(slot);
+    floor_changed = true;
+  }
+  release_batch(slots);
+  advance_first_tube();
+
+  // do the same for the static blocks of merged tubes
+  auto bit = _static_blocks.begin();
+  while (bit != _static_blocks.end()) {
+    btRigidBody* block = *bit;
+    block->getAabb(aabb_min, aabb_max);
+    if (aabb_max.y() >= bottom_of_band) {
+      ++bit;
+      continue;
+    }
+
+    btCompoundShape* block_shape = static_cast<btCompoundShape*>(block->getCollisionShape());
+    for (int i=0; i<block_shape->getNumChildShapes(); ++i) {
+      add_to_height_map(_floor, block->getWorldTransform()*block_shape->getChildTransform(i), block_shape->getChildShape(i));
+    }
+    deleteRigidBody(block);
+    m_collisionShapes.remove(block_shape);
+    delete block_shape;
+    bit = _static_blocks.erase(bit);
+    floor_changed = true;
+  }
+
+  if (floor_changed)
+    update_floor();
+}
+
+// add the images of the frozen sections that are within ghost_width of an edge of a periodic cell. a section near the -x edge gets an
+// image one period further in +x, right behind the +x edge, and the other way around. a section near a corner also gets an image
+// in the diagonal neighbor cell. the images are static bodies in the frozen group, so they only collide with the dynamic tubes.
+void cnt_mesh::add_ghosts(tube& t) {
+  if (not _periodic)
+    return;
+
+  float width = ghost_width();
+  btVector3 aabb_min, aabb_max;
+  for (int i=t.first_section; i<t.first_section+t.number_of_sections; ++i) {
+    btCollisionObject* obj = _section_bodies[i];
+    obj->getCollisionShape()->getAabb(obj->getWorldTransform(), aabb_min, aabb_max);
+
+    btScalar x_shifts[3] = {0}, z_shifts[3] = {0};
+    int number_of_x_shifts = 1, number_of_z_shifts = 1;
+    if (aabb_min.x() < -_half_Lx+width)
+      x_shifts[number_of_x_shifts++] = 2*_half_Lx;
+    if (aabb_max.x() > _half_Lx-width)
+      x_shifts[number_of_x_shifts++] = -2*_half_Lx;
+    if (aabb_min.z() < -_half_Lz+width)
+      z_shifts[number_of_z_shifts++] = 2*_half_Lz;
+    if (aabb_max.z() > _half_Lz-width)
+      z_shifts[number_of_z_shifts++] = -2*_half_Lz;
+
+    for (int ix=0; ix<number_of_x_shifts; ++ix) {
+      for (int iz=0; iz<number_of_z_shifts; ++iz) {
+        if ((ix == 0) and (iz == 0))
+          continue;
+        btTransform trans = obj->getWorldTransform();
+        trans.getOrigin() += btVector3(x_shifts[ix], 0, z_shifts[iz]);
+        btRigidBody* ghost = create_section_body(0, trans, obj->getCollisionShape(), -1, 0); // ghosts do not belong to any tube
+        create_graphics_object(ghost);
+        t.ghosts.push_back(ghost);
+      }
+    }
+  }
+}
+
+// move the dynamic tubes whose center left a periodic cell by a whole number of periods back into the cell. all the sections of a
+// tube are moved together, so the constraints and the joints between them are not disturbed.
+// the dynamic tubes have no images, so the periodicity is approximate: two dynamic tubes on opposite edges of the cell can overlap
+// through the boundary and do not push each other until one of them freezes and gets its images. the tubes that settle near the
+// edges are therefore not equivalent to the tubes in the bulk of the film.
+void cnt_mesh::wrap_dynamic_tubes() {
+  if (not _periodic)
+    return;
+
+  btAlignedObjectArray<btQuaternion> world_to_local;
+  btAlignedObjectArray<btVector3> local_origin;
+
+  for (int slot=_first_dynamic; slot<int(tubes.size()); ++slot) {
+    tube& t = tubes[slot];
+    if (not t.isDynamic)
+      continue;
+
+    btVector3 center(0,0,0);
+    for (int i=t.first_section; i<t.first_section+t.number_of_sections; ++i) {
+      center += _section_bodies[i]->getWorldTransform().getOrigin();
+    }
+    center /= t.number_of_sections;
+
+    btVector3 shift(height_map::wrap(center.x(), _half_Lx)-center.x(), 0, height_map::wrap(center.z(), _half_Lz)-center.z());
+    if ((shift.x() == 0) and (shift.z() == 0))
+      continue;
+
+    if (t.multibody) {
+      t.multibody->setBasePos(t.multibody->getBasePos()+shift);
+      t.multibody->updateCollisionObjectWorldTransforms(world_to_local, local_origin);
+    } else {
+      for (int i=t.first_section; i<t.first_section+t.number_of_sections; ++i) {
+        btRigidBody* b = btRigidBody::upcast(_section_bodies[i]);
+        btTransform trans = b->getWorldTransform();
+        trans.getOrigin() += shift;
+        b->setWorldTransform(trans);
+        b->setInterpolationWorldTransform(trans);
+        b->getMotionState()->setWorldTransform(trans);
+      }
+    }
+
+    for (int i=t.first_section; i<t.first_section+t.number_of_sections; ++i) {
+      m_dynamicsWorld->updateSingleAabb(_section_bodies[i]);
+    }
+  }
+}
+
+// raise a height map under a section. the section shapes are all aligned with their local y-axis, so the section is treated as a
+// segment along the local y-axis with the radius of the shape.
+void cnt_mesh::add_to_height_map(height_map& map, const btTransform& trans, const btCollisionShape* shape) {
+  btVector3 aabb_min, aabb_max;
+  shape->getAabb(btTransform::getIdentity(), aabb_min, aabb_max);
+  btScalar radius = aabb_max.x();
+  btScalar half_length = std::max(btScalar(0), aabb_max.y()-radius);
+
+  btVector3 ax = trans.getBasis().getColumn(1);
+  btVector3 p0 = trans.getOrigin() - half_length*ax;
+  btVector3 p1 = trans.getOrigin() + half_length*ax;
+  map.add_segment(p0.x(), p0.y(), p0.z(), p1.x(), p1.y(), p1.z(), radius);
+}
+
+// recreate the static heightfield of the floor. the heightfield is centered in its aabb, so the body is placed at the center of the grid.
+void cnt_mesh::update_floor() {
+  // the gui has no way to remove a graphics shape, so the mesh of the old heightfield is kept and refilled with the new heights.
+  int graphics_shape = -1;
+  if (_floor_body) {
+    graphics_shape = _floor_shape->getUserIndex();
+    m_guiHelper->removeGraphicsInstance(_floor_body->getUserIndex());
+    deleteRigidBody(_floor_body);
+    for (auto& ghost: _floor_ghosts) {
+      deleteRigidBody(ghost);
+    }
+    _floor_ghosts.clear();
+    m_collisionShapes.remove(_floor_shape);
+    delete _floor_shape;
+  }
+
+  float min_height = _floor.min_height();
+  float max_height = _floor.max_height();
+
+  _floor_shape = new btHeightfieldTerrainShape(_floor.nx, _floor.nz, _floor.heights.data(), 1, min_height, max_height, 1, PHY_FLOAT, false);
+  _floor_shape->setLocalScaling(btVector3(_floor.spacing, 1, _floor.spacing));
+  m_collisionShapes.push_back(_floor_shape);
+
+  btTransform floor_transform;
+  floor_transform.setIdentity();
+  floor_transform.setOrigin(btVector3((_floor.x(0)+_floor.x(_floor.nx-1))/2., (min_height+max_height)/2., (_floor.z(0)+_floor.z(_floor.nz-1))/2.));
+
+  _floor_body = createRigidBody(0, floor_transform, _floor_shape);
+  _floor_body->forceActivationState(ISLAND_SLEEPING);
+  if ((graphics_shape >= 0) and m_guiHelper->getRenderInterface()) {
+    update_floor_graphics_shape(graphics_shape);
+  }
+  create_graphics_object(_floor_body, btVector4(1,1,1,1));
+
+  // the images of the floor in the eight neighbor cells share the heightfield shape. they are not drawn, so they have no graphics instance.
+  if (_periodic) {
+    for (int dx=-1; dx<=1; ++dx) {
+      for (int dz=-1; dz<=1; ++dz) {
+        if ((dx == 0) and (dz == 0))
+          continue;
+        btTransform ghost_transform = floor_transform;
+        ghost_transform.getOrigin() += btVector3(2*dx*_half_Lx, 0, 2*dz*_half_Lz);
+        btRigidBody* ghost = createRigidBody(0, ghost_transform, _floor_shape);
+        ghost->forceActivationState(ISLAND_SLEEPING);
+        _floor_ghosts.push_back(ghost);
+      }
+    }
+  }
+}
+
+// write the triangles of the current heightfield into the graphics shape of the previous floor. the grid of the floor never changes,
+// so the heightfield has as many triangles as the one that the gui registered for the first floor.
+void cnt_mesh::update_floor_graphics_shape(int graphics_shape) {
+  // collect three vertices per triangle in the vertex layout of the gui: position (xyzw), normal (xyz), and texture coordinates (uv)
+  struct triangle_collector: public btTriangleCallback {
+    std::vector<float> vertices;
+    void processTriangle(btVector3* triangle, int partId, int triangleIndex) override {
+      btVector3 normal = (triangle[1]-triangle[0]).cross(triangle[2]-triangle[0]).normalized();
+      for (int v=0; v<3; ++v) {
+        vertices.insert(vertices.end(), {float(triangle[v].x()), float(triangle[v].y()), float(triangle[v].z()), 1,
+                                         float(normal.x()), float(normal.y()), float(normal.z()), 0.5, 0.5});
       }
-      my_tube.bodies.clear();
     }
-    tubes.pop_front();
+  } collector;
+
+  btVector3 aabb_min(-BT_LARGE_FLOAT, -BT_LARGE_FLOAT, -BT_LARGE_FLOAT);
+  btVector3 aabb_max(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
+  _floor_shape->processAllTriangles(&collector, aabb_min, aabb_max);
+
+  m_guiHelper->getRenderInterface()->updateShape(graphics_shape, collector.vertices.data());
+  _floor_shape->setUserIndex(graphics_shape);
+}
+
+// seed the random number streams. every stream gets its own seed sequence made of the run seed and the number of the stream.
+void cnt_mesh::seed_random_streams(long long seed) {
+  if (seed < 0)
+    seed = std::random_device{}() & 0x7fffffff;
+  _random_seed = seed;
+
+  std::mt19937_64* streams[] = {&_drop_site_rng, &_orientation_rng, &_tube_length_rng, &_section_length_rng};
+  std::uint32_t low = std::uint32_t(_random_seed), high = std::uint32_t(_random_seed >> 32);
+  for (std::uint32_t i=0; i<4; ++i) {
+    std::seed_seq seq{low, high, i};
+    streams[i]->seed(seq);
   }
+
+  std::cout << "seeded the random number generators with seed " << _random_seed << std::endl;
 }
 
 // this method gives the appropriate coordinate for releasing the next tube
 btVector3 cnt_mesh::drop_coordinate() {
-  return btVector3(   _half_Lx*((2.0*float(std::rand())/float(RAND_MAX))-1.0),
-                      drop_height + Ly,
-                      _half_Lz*((2.0*float(std::rand())/float(RAND_MAX))-1.0)
+  return btVector3(   random_uniform(_drop_site_rng, -_half_Lx, _half_Lx),
+                      drop_height + _surface_height,
+                      random_uniform(_drop_site_rng, -_half_Lz, _half_Lz)
                   );
 }
 
+// gives the coordinate for releasing a tube with axis ax and the given length. with the height map drop site selection, a few random
+// candidate sites are tried and the one where the film under the tube is lowest is chosen. the tube is then released drop_height
+// above the highest point of the film under it instead of above the average height of the film.
+btVector3 cnt_mesh::drop_coordinate(const btVector3& ax, float length) {
+  if (not _height_map_drop)
+    return drop_coordinate();
+
+  btVector3 best_site;
+  float best_height = std::numeric_limits<float>::max();
+  for (int i=0; i<_drop_site_candidates; ++i) {
+    btVector3 site = drop_coordinate();
+    btVector3 p0 = site - 0.5*length*ax;
+    btVector3 p1 = site + 0.5*length*ax;
+    float film_height = _surface.max_along_segment(p0.x(), p0.z(), p1.x(), p1.z());
+    if (film_height < best_height) {
+      best_height = film_height;
+      best_site = site;
+    }
+  }
+
+  best_site.setY(best_height + drop_height);
+  return best_site;
+}
+
+// register the graphics instance of a single body. this does the same thing as autogenerateGraphicsObjects, but only for one body,
+// so the cost of adding a tube does not grow with the number of objects that are already in the world.
+void cnt_mesh::create_graphics_object(btCollisionObject* obj, const btVector4& color) {
+  m_guiHelper->createCollisionShapeGraphicsObject(obj->getCollisionShape());
+  m_guiHelper->createCollisionObjectGraphicsObject(obj, color);
+}
+
+// pick a color for a body from the same palette that the OpenGLGuiHelper uses
+void cnt_mesh::create_graphics_object(btCollisionObject* obj) {
+  static const btVector4 colors[4] = {
+    btVector4(60./256.,186./256.,84./256.,1),
+    btVector4(244./256.,194./256.,13./256.,1),
+    btVector4(219./256.,50./256.,54./256.,1),
+    btVector4(72./256.,133./256.,237./256.,1)
+  };
+  create_graphics_object(obj, colors[obj->getBroadphaseHandle()->getUid() & 3]);
+}
+
+// find the height at which a tube with orientation qt would touch the film if it was moved straight down from drop_coor. this is done
+// by sweeping a box that encloses the tube down the drop column. the returned height is a small clearance above the contact point.
+btScalar cnt_mesh::sweep_drop_height(const btVector3& drop_coor, const btQuaternion& qt, float length, float diameter) {
+  // the sections of the tube can extend beyond length by up to one section length
+  btBoxShape tube_box(btVector3(diameter/2., length/2.+_section_length.back(), diameter/2.));
+
+  btTransform from(qt, drop_coor);
+  btTransform to(qt, btVector3(drop_coor.x(), -diameter, drop_coor.z()));
+
+  btCollisionWorld::ClosestConvexResultCallback callback(from.getOrigin(), to.getOrigin());
+  m_dynamicsWorld->convexSweepTest(&tube_box, from, to, callback);
+
+  if (not callback.hasHit())
+    return drop_coor.y();
+
+  btScalar contact_height = from.getOrigin().y() + callback.m_closestHitFraction*(to.getOrigin().y()-from.getOrigin().y());
+  return std::min(drop_coor.y(), contact_height+_sweep_clearance);
+}
+
 void cnt_mesh::renderScene() {
   CommonRigidBodyBase::renderScene();
 }
@@ -230,10 +1046,8 @@ void cnt_mesh::save_one_tube(tube &t) {
   position_file << "tube number: " << number_of_saved_tubes << " ; ";
   orientation_file << "tube number: " << number_of_saved_tubes << " ; ";
 
-  int i=0;
-  btTransform trans;
-  for (const auto& b: t.bodies) {
-    b->getMotionState()->getWorldTransform(trans);
+  for (int i=t.first_section; i<t.first_section+t.number_of_sections; ++i) {
+    const btTransform& trans = _section_bodies[i]->getWorldTransform();
     position_file << trans.getOrigin().x() << " , " << trans.getOrigin().y() << " , " << trans.getOrigin().z() << " ; ";
     
     btQuaternion qt = trans.getRotation();
@@ -241,7 +1055,7 @@ void cnt_mesh::save_one_tube(tube &t) {
     ax = ax.rotate(qt.getAxis(), qt.getAngle());
     orientation_file << ax.x() << " , " << ax.y() << " , " << ax.z() << " ; ";
 
-    length_file << t.body_length[i++] << ";";
+    length_file << _body_length[i] << ";";
   }
 
   position_file << std::endl;
@@ -249,30 +1063,167 @@ void cnt_mesh::save_one_tube(tube &t) {
   length_file << std::endl;
 }
 
+// volume of a section. the capsule and the multi sphere shapes have the same geometry: a cylinder with two hemispherical caps.
+float cnt_mesh::section_volume(float diameter, float length) {
+  const float pi = 3.14159265358979323846;
+  float r = diameter/2.;
+  if (_section_shape == "cylinder")
+    return pi*r*r*length;
+  return pi*r*r*std::max(float(0), length-diameter) + 4./3.*pi*r*r*r;
+}
+
+// update Ly and the reference height of the surface for dropping new tubes. these are read from the running aggregates of the
+// surface height map, which is updated when the tubes freeze. the settled surface is rebuilt from the surface height map and the
+// dynamic tubes at rest, which only scans the dynamic tubes.
 void cnt_mesh::get_Ly() {
-  btTransform trans;
-  float avgY=0;
-  int count=0;
-  for (const auto& t:tubes) {
-    if (t.isDynamic) {
-      for (const auto& b: t.bodies) {
-        b->getMotionState()->getWorldTransform(trans);
-        avgY += trans.getOrigin().getY();
-        count++;
+  Ly = _surface.mean_height();
+  _surface_height = reference_height(_surface);
+
+  _settled_surface = _surface;
+  for (int slot=_first_dynamic; slot<int(tubes.size()); ++slot) {
+    tube& t = tubes[slot];
+    if ((not t.isDynamic) or (not tube_at_rest(t)))
+      continue;
+    for (int i=t.first_section; i<t.first_section+t.number_of_sections; ++i) {
+      add_to_height_map(_settled_surface, _section_bodies[i]->getWorldTransform(), _section_bodies[i]->getCollisionShape());
+    }
+  }
+  _settled_surface_height = reference_height(_settled_surface);
+}
+
+// the percentile, the maximum, or the mean height of a surface height map, as set by the "drop height reference"
+float cnt_mesh::reference_height(const height_map& map) {
+  if (_drop_height_reference == "percentile") {
+    return map.percentile_height(_surface_height_percentile);
+  } else if (_drop_height_reference == "max") {
+    return map.max_height();
+  }
+  return map.mean_height();
+}
+
+// step the simulation. with the adaptive time step, the time step is chosen such that the fastest section moves at most a fraction
+// (courant number) of the shortest section length in one internal step. quiet phases are taken with the maximum time step, and
+// when the time step would drop below the minimum time step, the minimum time step is split into as many substeps as needed.
+void cnt_mesh::stepSimulation(float deltaTime) {
+  if (not m_dynamicsWorld)
+    return;
+
+  int max_substeps = 10;
+  btScalar fixed_time_step = deltaTime;
+
+  if (_adaptive_time_step) {
+    float courant_time_step = _max_time_step;
+    if (not std::isfinite(_max_active_velocity))
+      courant_time_step = 0;
+    else if (_max_active_velocity > 0)
+      courant_time_step = _courant_number*_section_length.front()/_max_active_velocity;
+
+    bool shortened = false;
+    if (not (courant_time_step > 0)) {
+      // a velocity that is not finite (e.g. a constraint blowing up) has no courant time step, so the minimum time step is taken
+      // in a single substep.
+      shortened = true;
+      deltaTime = _min_time_step;
+      max_substeps = 1;
+    } else {
+      deltaTime = std::clamp(courant_time_step, _min_time_step, _max_time_step);
+
+      // a velocity spike makes the courant time step tiny. instead of asking for millions of substeps, the step is shortened to
+      // _max_substeps substeps of the courant time step, so the spike is still resolved and the step takes a bounded time.
+      float number_of_substeps = std::ceil(deltaTime/courant_time_step);
+      if (number_of_substeps > _max_substeps) {
+        shortened = true;
+        number_of_substeps = _max_substeps;
+        deltaTime = _max_substeps*std::min(_min_time_step, courant_time_step);
       }
+      max_substeps = std::max(1, int(number_of_substeps));
+    }
+    fixed_time_step = deltaTime/max_substeps;
+
+    // the warning is printed for the first shortened step and then once every 1000 shortened steps, so a long spike does not flood
+    // the output from the stepping loop.
+    if (shortened and (_number_of_shortened_steps++ % 1000 == 0)) {
+      std::cout << "warning: the adaptive time step is shortened to " << max_substeps << " substeps of " << fixed_time_step
+                << " [s] for a maximum velocity of " << _max_active_velocity << " [nm/s] (" << _number_of_shortened_steps
+                << " shortened steps so far)!!!" << std::endl;
     }
   }
 
-  if (count==0) {
-    Ly = 0;
-  } else {
-    Ly = avgY/float(count);
+  auto start = std::chrono::steady_clock::now();
+  int number_of_substeps = m_dynamicsWorld->stepSimulation(deltaTime,max_substeps,fixed_time_step);
+  _step_wall_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+  _number_of_substeps += number_of_substeps;
+  _number_of_steps++;
+  // bullet keeps the remainder of deltaTime that does not fill a whole substep for the next step, so only the substeps that are
+  // taken count as simulated time
+  _simulated_time += number_of_substeps*fixed_time_step;
+
+  wrap_dynamic_tubes();
+  update_active_velocity();
+}
+
+// update the maximum velocity and the kinetic energy of the sections of the dynamic tubes. all the dynamic tubes are after
+// _first_dynamic. this is done after every step, so the number of steps that each dynamic tube has been sleeping is counted here too.
+void cnt_mesh::update_active_velocity() {
+  float max_velocity2=0;
+  float kinetic_energy=0;
+
+  btAlignedObjectArray<btVector3> link_omega, link_velocity;
+
+  for (int slot=_first_dynamic; slot<int(tubes.size()); ++slot) {
+    tube& t = tubes[slot];
+    if (not t.isDynamic)
+      continue;
+
+    bool sleeping = true;
+    if (t.multibody) {
+      sleeping = not t.multibody->isAwake();
+    } else {
+      for (int i=t.first_section; sleeping and (i<t.first_section+t.number_of_sections); ++i) {
+        sleeping = (_section_bodies[i]->getActivationState() == ISLAND_SLEEPING);
+      }
+    }
+    t.sleeping_steps = sleeping ? t.sleeping_steps+1 : 0;
+
+    // the velocities of the links of a multibody are only available in the local frames of the links, which is enough for their magnitude
+    if (t.multibody) {
+      link_omega.resize(t.number_of_sections);
+      link_velocity.resize(t.number_of_sections);
+      t.multibody->compTreeLinkVelocities(&link_omega[0], &link_velocity[0]);
+      for (int k=0; k<t.number_of_sections; ++k) {
+        max_velocity2 = std::max(max_velocity2, float(link_velocity[k].length2()));
+      }
+      kinetic_energy += t.multibody->getKineticEnergy();
+      continue;
+    }
+
+    for (int i=t.first_section; i<t.first_section+t.number_of_sections; ++i) {
+      const btRigidBody* b = btRigidBody::upcast(_section_bodies[i]);
+      btScalar v2 = b->getLinearVelocity().length2();
+      max_velocity2 = std::max(max_velocity2, float(v2));
+
+      // rotational energy is calculated in the local frame of the body where the inertia tensor is diagonal
+      btVector3 w = b->getAngularVelocity()*b->getWorldTransform().getBasis();
+      btVector3 inv_inertia = b->getInvInertiaDiagLocal();
+      btScalar rotational_energy = 0;
+      for (int k=0; k<3; ++k) {
+        if (inv_inertia[k] > 0)
+          rotational_energy += w[k]*w[k]/inv_inertia[k];
+      }
+
+      kinetic_energy += 0.5*(v2/b->getInvMass() + rotational_energy);
+    }
   }
-  
+
+  _max_active_velocity = std::sqrt(max_velocity2);
+  _active_kinetic_energy = kinetic_energy;
 }
 
-// set and save the json properties that is read and parsed from the input_json file.
+// set and save the json properties that is read and parsed from the input_json file. a negative random seed is replaced by the
+// seed that was drawn in parse_json_prop, so the run can be repeated from its own input.json.
 void cnt_mesh::save_json_properties(nlohmann::json j) {
+  j["random seed"] = _random_seed;
+
   std::ofstream json_file;
   json_file.open(_output_directory.path() / "input.json", std::ios::out);
   json_file << std::setw(4) << j << std::endl;
@@ -284,11 +1235,14 @@ void cnt_mesh::add_tube() {
 
   tubes.push_back(tube());
   tube& my_tube = tubes.back();
+  my_tube.id = _number_of_added_tubes++;
+  _number_of_dynamic_tubes++;
+  my_tube.first_section = _section_bodies.size();
 
-  int d = std::rand()%_tube_section_collision_shapes.size(); // index related to the diameter of the tube
+  int d = random_index(_tube_length_rng, _tube_section_collision_shapes.size()); // index related to the diameter of the tube
   my_tube.diameter = _tube_diameter[d];
   
-  int l = std::rand()%_tube_length.size(); // index related to the length of the tube
+  int l = random_index(_tube_length_rng, _tube_length.size()); // index related to the length of the tube
   float length = _tube_length[l];
 
   btVector3 _drop_coordinate = drop_coordinate();
@@ -310,7 +1264,7 @@ void cnt_mesh::add_tube() {
   float c_length=0;
 
   while(c_length<length) {
-    int sl = std::rand()%_section_length.size();
+    int sl = random_index(_section_length_rng, _section_length.size());
     colShape = _tube_section_collision_shapes[d][sl];
 
 
@@ -333,9 +1287,13 @@ void cnt_mesh::add_tube() {
     // startTransform.setRotation(btQuaternion(0, 1, 1, 0)); // set cylinder axis along z-direction
     
 
-    my_tube.bodies.push_back(createRigidBody(mass,startTransform,colShape));	// no static object
-    my_tube.bodies.back()->setMassProps(1.0,btVector3(1,0,1)); // turn off rotation along the y-axis of the cylinder shapes
-    my_tube.body_length.push_back(_section_length[sl]);
+    btRigidBody* body = create_section_body(mass,startTransform,colShape,my_tube.id,my_tube.number_of_sections);	// no static object
+    body->setMassProps(1.0,btVector3(1,0,1)); // turn off rotation along the y-axis of the cylinder shapes
+    _section_bodies.push_back(body);
+    _body_length.push_back(_section_length[sl]);
+    _section_constraints.push_back(nullptr);
+    _section_joint_limits.push_back(nullptr);
+    my_tube.number_of_sections++;
 
     c_length += _section_length[sl]+my_tube.diameter;
   }
@@ -383,8 +1341,10 @@ void cnt_mesh::add_tube() {
   // }
 
 
-  // generate the graphical representation of the object
-  m_guiHelper->autogenerateGraphicsObjects(m_dynamicsWorld);
+  // generate the graphical representation of the new bodies
+  for (int i=my_tube.first_section; i<my_tube.first_section+my_tube.number_of_sections; ++i) {
+    create_graphics_object(_section_bodies[i]);
+  }
 }
 
 // this method adds a tube in the xz plane
@@ -394,15 +1354,18 @@ void cnt_mesh::add_tube_in_xz(){
 
   tubes.push_back(tube());
   tube& my_tube = tubes.back();
+  my_tube.id = _number_of_added_tubes++;
+  _number_of_dynamic_tubes++;
+  my_tube.first_section = _section_bodies.size();
 
-  int d = std::rand()%_tube_section_collision_shapes.size(); // index related to the diameter of the tube
+  int d = random_index(_tube_length_rng, _tube_section_collision_shapes.size()); // index related to the diameter of the tube
   my_tube.diameter = _tube_diameter[d];
   
-  int l = std::rand()%_tube_length.size(); // index related to the length of the tube
+  int l = random_index(_tube_length_rng, _tube_length.size()); // index related to the length of the tube
   float length = _tube_length[l];
 
   // set drop orientation of the tube
-  float angle = float(std::rand()%1000)/1000.*pi;
+  float angle = float(random_index(_orientation_rng, 1000))/1000.*pi;
   btVector3 ax(std::cos(angle),0,std::sin(angle)); // axis vector for the tube sections
   
   // set a quaternion to determine the orientation of tube sections, note that the initial orientation of the tube sections are along the y-axis
@@ -410,8 +1373,13 @@ void cnt_mesh::add_tube_in_xz(){
   btVector3 q_axis = ax.rotate(btVector3(0,1,0),pi/2); // axis vector for the quaternion describing orientation of tube sections
   qt.setRotation(q_axis,pi/2);
 
-  btVector3 drop_coor = drop_coordinate();
+  btVector3 drop_coor = drop_coordinate(ax, length);
   // btVector3 drop_coor(0,Ly,0);
+
+  // place the tube right above the film instead of letting it fall all the way from the drop height
+  if (_sweep_placement) {
+    drop_coor.setY(sweep_drop_height(drop_coor, qt, length, my_tube.diameter));
+  }
   
   // set the density of the material making the tubes
   btScalar density=1;
@@ -421,8 +1389,13 @@ void cnt_mesh::add_tube_in_xz(){
 
   float c_length=0;
 
+  // transforms, shapes and masses of the sections, which are needed to build the whole multibody at once
+  std::vector<btTransform> transforms;
+  std::vector<btCollisionShape*> shapes;
+  std::vector<btScalar> masses;
+
   while(c_length<length) {
-    int sl = std::rand()%_section_length.size();
+    int sl = random_index(_section_length_rng, _section_length.size());
     btScalar sec_length_plus_distances = 1.*_section_length[sl];
 
     colShape = _tube_section_collision_shapes[d][sl];
@@ -439,23 +1412,77 @@ void cnt_mesh::add_tube_in_xz(){
     startTransform.setRotation(qt);
 
 
-    // create rigid bodies
-    my_tube.bodies.push_back(createRigidBody(mass,startTransform,colShape));	// no static object
-    // my_tube.bodies.back()->setMassProps(mass,btVector3(1,0,1)); // turn off rotation along the y-axis of the cylinder shapes
-    my_tube.body_length.push_back(sec_length_plus_distances);
+    // create rigid bodies. the sections of a multibody tube are created after all of them are known.
+    if (_multibody) {
+      _section_bodies.push_back(nullptr);
+      transforms.push_back(startTransform);
+      shapes.push_back(colShape);
+      masses.push_back(mass);
+    } else {
+      _section_bodies.push_back(create_section_body(mass,startTransform,colShape,my_tube.id,my_tube.number_of_sections));	// no static object
+      // _section_bodies.back()->setMassProps(mass,btVector3(1,0,1)); // turn off rotation along the y-axis of the cylinder shapes
+    }
+    _body_length.push_back(sec_length_plus_distances);
+    _section_constraints.push_back(nullptr);
+    _section_joint_limits.push_back(nullptr);
+    my_tube.number_of_sections++;
 
-    c_length += my_tube.body_length.back();
+    c_length += _body_length.back();
   }
 
   my_tube.length = c_length;
 
-  //add N-1 constraints between the rigid bodies
-  for(int i=0;i<my_tube.bodies.size()-1;++i) {
-    btRigidBody* b1 = my_tube.bodies[i];
-    btRigidBody* b2 = my_tube.bodies[i+1];
-    
+  const int first = my_tube.first_section;
+  const int last = my_tube.first_section + my_tube.number_of_sections;
+
+  if (_multibody) {
+    create_multibody_tube(my_tube, transforms, shapes, masses);
+    if (_sweep_placement) {
+      my_tube.multibody->setBaseVel(btVector3(0,-_initial_drop_velocity,0));
+    }
+  } else if (_sweep_placement) {
+    for (int i=first; i<last; ++i) {
+      btRigidBody::upcast(_section_bodies[i])->setLinearVelocity(btVector3(0,-_initial_drop_velocity,0));
+    }
+  }
+
+  //add N-1 constraints between the rigid bodies of a rigid chain tube
+  if (not _multibody) {
+    connect_sections(my_tube);
+  }
+
+
+  // generate the graphical representation of the new bodies only, instead of walking all the objects in the world
+  for (int i=first; i<last; ++i) {
+    create_graphics_object(_section_bodies[i]);
+  }
+
+};
+
+// freeze all the dynamic tubes where they are and save all the remaining tubes. the output files are flushed, so the tubes are on
+// the disk even if the program does not exit normally after this.
+void cnt_mesh::flush_tubes() {
+  freeze_tubes(0);
+  save_tubes(0);
+
+  position_file.flush();
+  orientation_file.flush();
+  length_file.flush();
+}
+
+// add the cone twist constraints between the neighbor sections of a rigid chain tube
+void cnt_mesh::connect_sections(tube& my_tube) {
+  const float pi = 3.14159265358979323846;
+
+  const int first = my_tube.first_section;
+  const int last = my_tube.first_section + my_tube.number_of_sections;
+
+  for(int i=first;i<last-1;++i) {
+    btRigidBody* b1 = btRigidBody::upcast(_section_bodies[i]);
+    btRigidBody* b2 = btRigidBody::upcast(_section_bodies[i+1]);
+  
     // // spring constraint
-    // btPoint2PointConstraint* centerSpring = new btPoint2PointConstraint(*b1, *b2, btVector3(0,(my_tube.body_length[i])/2,0), btVector3(0,-(my_tube.body_length[i+1])/2,0));
+    // btPoint2PointConstraint* centerSpring = new btPoint2PointConstraint(*b1, *b2, btVector3(0,(_body_length[i])/2,0), btVector3(0,-(_body_length[i+1])/2,0));
     // centerSpring->m_setting.m_damping = 1.5; //the damping value for the constraint controls how stiff the constraint is. The default value is 1.0
     // centerSpring->m_setting.m_impulseClamp = 0; //The m_impulseClamp value controls how quickly the dynamic rigid body comes to rest. The defualt value is 0.0
 
@@ -464,12 +1491,12 @@ void cnt_mesh::add_tube_in_xz(){
     btTransform frameInA, frameInB;
     frameInA = btTransform::getIdentity();
     frameInA.getBasis().setEulerZYX(1, 0, 1);
-    frameInA.setOrigin(btVector3(0,my_tube.body_length[i]/2,0));
+    frameInA.setOrigin(btVector3(0,_body_length[i]/2,0));
     frameInB = btTransform::getIdentity();
     frameInB.getBasis().setEulerZYX(1,0, 1);
-    frameInB.setOrigin(btVector3(0,-my_tube.body_length[i+1]/2,0));
+    frameInB.setOrigin(btVector3(0,-_body_length[i+1]/2,0));
 
-    btConeTwistConstraint* centerSpring = new btConeTwistConstraint(*b1, *b2, frameInA, frameInB);
+    btConeTwistConstraint* centerSpring = _constraint_pool.create(*b1, *b2, frameInA, frameInB);
     centerSpring->setLimit(
                             0, // _swingSpan1
                             0, // _swingSpan2
@@ -481,28 +1508,349 @@ void cnt_mesh::add_tube_in_xz(){
 
 
     m_dynamicsWorld->addConstraint(centerSpring,false);
-    my_tube.constraints.push_back(centerSpring);
+    _section_constraints[i] = centerSpring;
+  }
+}
+
+// save the tubes and only leave number_of_unsaved_tubes of the newest tubes unsaved. only the frozen tubes are saved, so the
+// saving stops at the oldest tube that is still dynamic. the tubes that are already saved when they froze are skipped.
+void cnt_mesh::save_tubes(int number_of_unsaved_tubes) {
+  while (int(tubes.size())-_first_unsaved > number_of_unsaved_tubes) {
+    tube& my_tube = tubes[_first_unsaved];
+    if (my_tube.isDynamic)
+      break;
+    if ((not my_tube.isSaved) and (not my_tube.isRemoved)) {
+      save_one_tube(my_tube);
+      my_tube.isSaved=true;
+    }
+    _first_unsaved++;
   }
+}
+// a transform is stored as its origin followed by the rows of its basis, which (unlike a quaternion) gives back the exact transform
+static nlohmann::json transform_to_json(const btTransform& trans) {
+  const btVector3& o = trans.getOrigin();
+  const btMatrix3x3& b = trans.getBasis();
+  return {o.x(), o.y(), o.z(), b[0].x(), b[0].y(), b[0].z(), b[1].x(), b[1].y(), b[1].z(), b[2].x(), b[2].y(), b[2].z()};
+}
 
+static btTransform transform_from_json(const nlohmann::json& j) {
+  std::vector<btScalar> v = j.get<std::vector<btScalar>>();
+  btTransform trans;
+  trans.setOrigin(btVector3(v[0], v[1], v[2]));
+  trans.setBasis(btMatrix3x3(v[3], v[4], v[5], v[6], v[7], v[8], v[9], v[10], v[11]));
+  return trans;
+}
 
-  // generate the graphical representation of the object
-  m_guiHelper->autogenerateGraphicsObjects(m_dynamicsWorld);
+static nlohmann::json vector_to_json(const btVector3& vec) {
+  return {vec.x(), vec.y(), vec.z()};
+}
 
-};
+static btVector3 vector_from_json(const nlohmann::json& j) {
+  std::vector<btScalar> v = j.get<std::vector<btScalar>>();
+  return btVector3(v[0], v[1], v[2]);
+}
 
-// make tubes static in the simulation and only leave number_of_active_tubes as dynamic in the simulation.
-void cnt_mesh::save_tubes(int number_of_unsaved_tubes) {
-  if (tubes.size() <= number_of_unsaved_tubes)
-    return;
+// write the checkpoint. the tubes are stored from _first_tube on, with the transforms and velocities of their sections and the joint
+// state of the multibody tubes, and the static blocks with the transforms of their children. the section shapes are stored as their
+// index in _tube_section_collision_shapes. the output files are flushed and their sizes are stored, so that the lines that are
+// written after the checkpoint can be cut off when the run is resumed.
+void cnt_mesh::save_checkpoint() {
+  namespace fs = std::experimental::filesystem;
+
+  std::unordered_map<const btCollisionShape*, int> shape_index;
+  for (std::size_t d=0; d<_tube_section_collision_shapes.size(); ++d) {
+    for (std::size_t sl=0; sl<_tube_section_collision_shapes[d].size(); ++sl) {
+      shape_index[_tube_section_collision_shapes[d][sl]] = d*_section_length.size()+sl;
+    }
+  }
 
-  auto it = prev(tubes.end(),number_of_unsaved_tubes);
+  nlohmann::json cp;
 
-  int n=0;
-  while(!it->isSaved){
-    save_one_tube(*it);
-    it->isSaved=true;
-    it--;
-    if (it==tubes.begin())
-      break;
+  cp["random seed"] = _random_seed;
+  std::mt19937_64* streams[] = {&_drop_site_rng, &_orientation_rng, &_tube_length_rng, &_section_length_rng};
+  const char* stream_names[] = {"drop site", "orientation", "tube length", "section length"};
+  for (int i=0; i<4; ++i) {
+    std::ostringstream state;
+    state << *streams[i];
+    cp["random streams"][stream_names[i]] = state.str();
+  }
+
+  cp["number of saved tubes"] = number_of_saved_tubes;
+  cp["number of output files"] = number_of_cnt_output_files;
+  std::fstream* files[] = {&position_file, &orientation_file, &length_file};
+  cp["output file sizes"] = nlohmann::json::array();
+  for (auto& f: files) {
+    f->flush();
+    cp["output file sizes"].push_back(f->is_open() ? std::streamoff(f->tellp()) : 0);
+  }
+
+  cp["number of added tubes"] = _number_of_added_tubes;
+  cp["number of substeps"] = _number_of_substeps;
+  cp["simulated time [s]"] = _simulated_time;
+  cp["number of steps"] = _number_of_steps;
+  cp["step wall time [s]"] = _step_wall_time;
+  cp["broadphase time [s]"] = _broadphase_timer->broadphase_time;
+  cp["deposited volume"] = _deposited_volume;
+  cp["density band volume"] = _density_band_volume;
+  cp["Ly"] = Ly;
+  cp["surface height"] = _surface_height;
+  cp["max active velocity"] = _max_active_velocity;
+  cp["active kinetic energy"] = _active_kinetic_energy;
+  cp["number of shortened steps"] = _number_of_shortened_steps;
+  cp["local time [s]"] = _step_clock->local_time();
+  cp["steps since last batch"] = _steps_since_last_batch;
+
+  cp["surface height map"] = _surface.heights;
+  cp["floor height map"] = _floor.heights;
+  cp["floor"] = (_floor_body != nullptr);
+
+  // the cursors are stored relative to the first tube, which is the first tube in the checkpoint
+  cp["first dynamic"] = std::max(0, _first_dynamic-_first_tube);
+  cp["first unsaved"] = std::max(0, _first_unsaved-_first_tube);
+
+  cp["static blocks"] = nlohmann::json::array();
+  for (auto& block: _static_blocks) {
+    btCompoundShape* block_shape = static_cast<btCompoundShape*>(block->getCollisionShape());
+    nlohmann::json children = nlohmann::json::array();
+    for (int i=0; i<block_shape->getNumChildShapes(); ++i) {
+      children.push_back({{"shape", shape_index.at(block_shape->getChildShape(i))}, {"transform", transform_to_json(block_shape->getChildTransform(i))}});
+    }
+    cp["static blocks"].push_back(children);
+  }
+
+  cp["tubes"] = nlohmann::json::array();
+  for (int slot=_first_tube; slot<int(tubes.size()); ++slot) {
+    const tube& t = tubes[slot];
+    nlohmann::json jt;
+    jt["id"] = t.id;
+    jt["diameter"] = t.diameter;
+    jt["length"] = t.length;
+    jt["dynamic"] = t.isDynamic;
+    jt["saved"] = t.isSaved;
+    jt["removed"] = t.isRemoved;
+    jt["sleeping steps"] = t.sleeping_steps;
+
+    // the sections of the removed tubes are already gone, the tube is only kept to hold its slot
+    jt["sections"] = nlohmann::json::array();
+    for (int i=t.first_section; (not t.isRemoved) and (i<t.first_section+t.number_of_sections); ++i) {
+      const btCollisionObject* obj = _section_bodies[i];
+      nlohmann::json js;
+      js["shape"] = shape_index.at(obj->getCollisionShape());
+      js["length"] = _body_length[i];
+      js["transform"] = transform_to_json(obj->getWorldTransform());
+      js["activation state"] = obj->getActivationState();
+      js["deactivation time"] = obj->getDeactivationTime();
+      const btRigidBody* b = btRigidBody::upcast(obj);
+      if (b) {
+        js["velocity"] = vector_to_json(b->getLinearVelocity());
+        js["angular velocity"] = vector_to_json(b->getAngularVelocity());
+      }
+      jt["sections"].push_back(js);
+    }
+
+    if (t.multibody) {
+      btMultiBody* mb = t.multibody;
+      nlohmann::json jm;
+      jm["base velocity"] = vector_to_json(mb->getBaseVel());
+      jm["base angular velocity"] = vector_to_json(mb->getBaseOmega());
+      jm["awake"] = mb->isAwake();
+      jm["joint positions"] = nlohmann::json::array();
+      jm["joint velocities"] = nlohmann::json::array();
+      for (int k=0; k<mb->getNumLinks(); ++k) {
+        const btScalar* q = mb->getJointPosMultiDof(k);
+        const btScalar* dq = mb->getJointVelMultiDof(k);
+        jm["joint positions"].push_back(std::vector<btScalar>(q, q+mb->getLink(k).m_posVarCount));
+        jm["joint velocities"].push_back(std::vector<btScalar>(dq, dq+mb->getLink(k).m_dofCount));
+      }
+      jt["multibody"] = jm;
+    }
+
+    cp["tubes"].push_back(jt);
+  }
+
+  // the old checkpoint is only replaced once the new one is completely written
+  fs::path checkpoint_path = _output_directory.path() / "checkpoint.cbor";
+  fs::path temporary_path = _output_directory.path() / "checkpoint.cbor.tmp";
+  std::vector<std::uint8_t> data = nlohmann::json::to_cbor(cp);
+  std::ofstream checkpoint_file(temporary_path, std::ios::out | std::ios::binary);
+  checkpoint_file.write(reinterpret_cast<const char*>(data.data()), data.size());
+  checkpoint_file.close();
+  fs::rename(temporary_path, checkpoint_path);
+}
+
+// continue the run from the checkpoint. the tubes are created again through the same paths as new and frozen tubes, with the
+// transforms, velocities and sleeping state of their sections. the contact manifolds and the warm starting impulses of the solver are
+// not in the checkpoint, so they are built up again in the first steps after the resume.
+void cnt_mesh::load_checkpoint() {
+  namespace fs = std::experimental::filesystem;
+
+  fs::path checkpoint_path = _output_directory.path() / "checkpoint.cbor";
+  if (not fs::exists(checkpoint_path))
+    throw std::invalid_argument("there is no checkpoint in the output directory to resume the run from.");
+
+  std::ifstream checkpoint_file(checkpoint_path, std::ios::in | std::ios::binary);
+  std::vector<std::uint8_t> data((std::istreambuf_iterator<char>(checkpoint_file)), std::istreambuf_iterator<char>());
+  nlohmann::json cp = nlohmann::json::from_cbor(data);
+
+  _random_seed = cp["random seed"];
+  std::mt19937_64* streams[] = {&_drop_site_rng, &_orientation_rng, &_tube_length_rng, &_section_length_rng};
+  const char* stream_names[] = {"drop site", "orientation", "tube length", "section length"};
+  for (int i=0; i<4; ++i) {
+    std::istringstream state(cp["random streams"][stream_names[i]].get<std::string>());
+    state >> *streams[i];
+  }
+
+  _number_of_added_tubes = cp["number of added tubes"];
+  _number_of_substeps = cp["number of substeps"];
+  _simulated_time = cp["simulated time [s]"];
+  _number_of_steps = cp["number of steps"];
+  _step_wall_time = cp["step wall time [s]"];
+  _broadphase_timer->broadphase_time = cp["broadphase time [s]"];
+  _deposited_volume = cp["deposited volume"];
+  _density_band_volume = cp["density band volume"];
+  Ly = cp["Ly"];
+  _surface_height = cp["surface height"];
+  _max_active_velocity = cp["max active velocity"];
+  _active_kinetic_energy = cp["active kinetic energy"];
+  _number_of_shortened_steps = cp["number of shortened steps"];
+  _step_clock->set_local_time(cp["local time [s]"].get<btScalar>());
+  _steps_since_last_batch = cp["steps since last batch"];
+
+  // the height maps are set point by point, so that their running aggregates are built up again
+  std::vector<float> heights = cp["surface height map"].get<std::vector<float>>();
+  for (int i=0; i<int(heights.size()); ++i) {
+    if (heights[i] != _surface.heights[i])
+      _surface.set_height(i, heights[i]);
+  }
+  heights = cp["floor height map"].get<std::vector<float>>();
+  for (int i=0; i<int(heights.size()); ++i) {
+    if (heights[i] != _floor.heights[i])
+      _floor.set_height(i, heights[i]);
+  }
+  if (cp["floor"].get<bool>())
+    update_floor();
+
+  std::vector<btCollisionShape*> shapes;
+  for (auto& shapes_of_diameter: _tube_section_collision_shapes) {
+    shapes.insert(shapes.end(), shapes_of_diameter.begin(), shapes_of_diameter.end());
   }
-}
\ No newline at end of file
+
+  for (auto& children: cp["static blocks"]) {
+    btCompoundShape* block_shape = new btCompoundShape(true);
+    m_collisionShapes.push_back(block_shape);
+    for (auto& child: children) {
+      block_shape->addChildShape(transform_from_json(child["transform"]), shapes[child["shape"].get<int>()]);
+    }
+    add_static_block(block_shape);
+  }
+
+  for (auto& jt: cp["tubes"]) {
+    tubes.push_back(tube());
+    tube& t = tubes.back();
+    t.id = jt["id"];
+    t.diameter = jt["diameter"];
+    t.length = jt["length"];
+    t.isDynamic = jt["dynamic"];
+    t.isSaved = jt["saved"];
+    t.isRemoved = jt["removed"];
+    t.sleeping_steps = jt["sleeping steps"];
+    t.first_section = _section_bodies.size();
+    if (t.isDynamic)
+      _number_of_dynamic_tubes++;
+
+    bool multibody = t.isDynamic and (jt.count("multibody") > 0);
+
+    // transforms, shapes and masses of the sections, which are needed to build the whole multibody at once
+    std::vector<btTransform> transforms;
+    std::vector<btCollisionShape*> section_shapes;
+    std::vector<btScalar> masses;
+
+    for (auto& js: jt["sections"]) {
+      btTransform trans = transform_from_json(js["transform"]);
+      btCollisionShape* shape = shapes[js["shape"].get<int>()];
+      float length = js["length"];
+      btScalar mass = t.isDynamic ? length : 0; // the density of the tubes is 1
+
+      _body_length.push_back(length);
+      _section_constraints.push_back(nullptr);
+      _section_joint_limits.push_back(nullptr);
+
+      if (multibody) {
+        _section_bodies.push_back(nullptr);
+        transforms.push_back(trans);
+        section_shapes.push_back(shape);
+        masses.push_back(mass);
+      } else {
+        btRigidBody* b = create_section_body(mass, trans, shape, t.id, t.number_of_sections);
+        if (t.isDynamic) {
+          b->setLinearVelocity(vector_from_json(js["velocity"]));
+          b->setAngularVelocity(vector_from_json(js["angular velocity"]));
+          b->forceActivationState(js["activation state"].get<int>());
+          b->setDeactivationTime(js["deactivation time"].get<btScalar>());
+        }
+        _section_bodies.push_back(b);
+      }
+      t.number_of_sections++;
+    }
+
+    if (multibody) {
+      const nlohmann::json& jm = jt["multibody"];
+      create_multibody_tube(t, transforms, section_shapes, masses);
+      btMultiBody* mb = t.multibody;
+      for (int k=0; k<mb->getNumLinks(); ++k) {
+        std::vector<btScalar> q = jm["joint positions"][k].get<std::vector<btScalar>>();
+        std::vector<btScalar> dq = jm["joint velocities"][k].get<std::vector<btScalar>>();
+        mb->setJointPosMultiDof(k, q.data());
+        mb->setJointVelMultiDof(k, dq.data());
+      }
+      mb->setBaseVel(vector_from_json(jm["base velocity"]));
+      mb->setBaseOmega(vector_from_json(jm["base angular velocity"]));
+
+      // move the link colliders to the restored joint positions
+      btAlignedObjectArray<btQuaternion> world_to_local;
+      btAlignedObjectArray<btVector3> local_origin;
+      mb->forwardKinematics(world_to_local, local_origin);
+      mb->updateCollisionObjectWorldTransforms(world_to_local, local_origin);
+
+      if (not jm["awake"].get<bool>())
+        mb->goToSleep();
+    } else if (t.isDynamic) {
+      connect_sections(t);
+    } else if (not t.isRemoved) {
+      add_ghosts(t); // the images of the frozen sections are not in the checkpoint
+    }
+
+    for (int i=t.first_section; i<t.first_section+t.number_of_sections; ++i) {
+      create_graphics_object(_section_bodies[i]);
+    }
+  }
+
+  _first_tube = 0;
+  _first_dynamic = cp["first dynamic"];
+  _first_unsaved = cp["first unsaved"];
+
+  // cut the output files back to their size at the checkpoint and keep appending to them. the output files that are started after
+  // the checkpoint are removed, since their tubes are saved again.
+  number_of_saved_tubes = cp["number of saved tubes"];
+  number_of_cnt_output_files = cp["number of output files"];
+  std::vector<std::uintmax_t> sizes = cp["output file sizes"].get<std::vector<std::uintmax_t>>();
+  const std::string extensions[] = {".pos.dat", ".orient.dat", ".len.dat"};
+  std::fstream* files[] = {&position_file, &orientation_file, &length_file};
+  for (int k=0; (number_of_cnt_output_files > 0) and (k<3); ++k) {
+    output_file_path = _output_directory.path() / ("tube"+std::to_string(number_of_cnt_output_files)+extensions[k]);
+    fs::resize_file(output_file_path, sizes[k]);
+    files[k]->open(output_file_path, std::ios::out | std::ios::app);
+    *files[k] << std::showpos << std::scientific;
+  }
+  for (int n=number_of_cnt_output_files+1; fs::exists(_output_directory.path() / ("tube"+std::to_string(n)+extensions[0])); ++n) {
+    for (auto& extension: extensions) {
+      fs::remove(_output_directory.path() / ("tube"+std::to_string(n)+extension));
+    }
+  }
+
+  // the settled surface is not in the checkpoint, it is rebuilt from the restored tubes for the height of the film
+  get_Ly();
+
+  std::cout << "resumed the run from the checkpoint with " << tubes.size() << " tubes, " << _static_blocks.size() << " static blocks, and "
+            << number_of_saved_tubes << " saved tubes" << std::endl;
+}
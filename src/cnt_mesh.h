@@ -5,16 +5,27 @@
 #include <ctime>
 #include <vector>
 #include <array>
-#include <list>
 #include <experimental/filesystem>
 #include <fstream>
+#include <algorithm>
+#include <random>
+#include <cstdint>
 
 #include "btBulletDynamicsCommon.h"
 #include "LinearMath/btVector3.h"
 #include "LinearMath/btAlignedObjectArray.h"
+#include "BulletCollision/CollisionShapes/btHeightfieldTerrainShape.h"
+#include "BulletDynamics/Featherstone/btMultiBody.h"
+#include "BulletDynamics/Featherstone/btMultiBodyDynamicsWorld.h"
+#include "BulletDynamics/Featherstone/btMultiBodyConstraint.h"
 
 #include "../lib/json.hpp"
 #include "./helper/prepare_directory.hpp"
+#include "./helper/height_map.hpp"
+#include "./helper/object_pool.hpp"
+#include "./helper/batch_world.hpp"
+#include "./helper/section_filter.hpp"
+#include "./helper/timed_world.hpp"
 
 #include "../misc_files/CommonInterfaces/CommonRigidBodyBase.h"
 
@@ -36,38 +47,250 @@ struct cnt_mesh : public CommonRigidBodyBase
 
 	// container properties
 	float _half_Lx,_half_Lz; // container size. y-axis is the direction in which the top of the container is open (vertical direction and the direction in which gravity is applied), Lx and Lz are the direction in which the container is enclosed
-	float Ly; // this is an average height for the stack of cnt mesh
+	float Ly; // mean height of the surface height map, which only holds the frozen tubes
+	float _surface_height; // reference height of the surface of the film above which new tubes are dropped
+	std::string _drop_height_reference; // "average", "percentile", or "max" height of the surface height map is used for _surface_height
+	float _surface_height_percentile=1; // fraction of the surface that is below _surface_height when the "percentile" reference is used
 
 	float drop_height=0;
 
+	// adaptive time step properties
+	bool _adaptive_time_step=false;
+	float _min_time_step=0, _max_time_step=0; // range of the adaptive time step
+	float _courant_number=0; // fraction of the shortest section length that the fastest section is allowed to move in one step
+	int _max_substeps=1; // largest number of substeps in one step, the step is shortened when the courant number needs more
+	long _number_of_substeps=0; // total number of internal steps of the dynamics world
+	long _number_of_shortened_steps=0; // number of adaptive steps that were shortened because of the maximum substeps or a velocity that is not finite
+	double _simulated_time=0; // total simulated time
+	int _steps_since_last_batch=0; // number of steps since the last batch of tubes was added
+
+	float _max_active_velocity=0; // maximum linear velocity of the sections of the dynamic tubes after the last step
+	float _active_kinetic_energy=0; // total kinetic energy of the sections of the dynamic tubes after the last step
+
+	// dynamics world properties
+	bool _multithreaded=false; // use btDiscreteDynamicsWorldMt instead of the single threaded btDiscreteDynamicsWorld
+	int _number_of_threads=1; // number of threads used by the task scheduler of the multithreaded dynamics world
+
+	// tube model: "rigid chain" of rigid bodies joined by cone twist constraints, or reduced coordinate "multibody" with spherical joints
+	bool _multibody=false;
+	float _multibody_swing_limit=0; // maximum swing angle of the spherical joints between the sections of a multibody tube
+	btMultiBodyDynamicsWorld* _multibody_world=nullptr; // the dynamics world when the multibody tube model is used
+
+	// broadphase properties
+	std::string _broadphase_type; // "dbvt", "axis sweep", "32 bit axis sweep", or "uniform grid"
+	float _broadphase_height=0; // upper bound of the axis sweep broadphases in the y direction
+	float _grid_cell_size=0; // cell size of the uniform grid broadphase
+	broadphase_timer* _broadphase_timer=nullptr; // the dynamics world seen through its broadphase timer
+	step_clock* _step_clock=nullptr; // the dynamics world seen through the time that it carries over to its next step
+
+	long long _max_number_of_objects=-1; // number of handles of the axis sweep broadphases
+
+	// upper bound of the number of collision objects in the world from the settings in input.json, -1 if it is not bounded
+	long long max_number_of_objects();
+
+	// create the broadphase that is selected in input.json
+	btBroadphaseInterface* create_broadphase();
+
 	std::vector<float> _tube_diameter;
 	std::vector<float> _section_length;
 	std::vector<float> _tube_length;
 	
 	std::vector<std::vector<btCollisionShape*>> _tube_section_collision_shapes; // first index determines the diameter, the second index determines the length of the section
-
-	// class to store information and the rigid bodies of each separate cnt.
+	std::string _section_shape; // collision shape of the tube sections: "cylinder", "capsule", or "multi sphere"
+
+	// volume of a tube section with the given diameter and length for the selected section shape
+	float section_volume(float diameter, float length);
+
+	double _deposited_volume=0; // total volume of the sections of the frozen tubes
+	// the packing density is measured in a fixed height band, so the films of different section shapes are compared over the same
+	// part of the film and the loose tubes at the top of the film are not counted
+	float _density_band_bottom=0, _density_band_top=0;
+	double _density_band_volume=0; // volume of the frozen sections that is inside the height band of the packing density
+	// add the part of the volume of a frozen section that is inside the height band of the packing density
+	void add_to_density_band(const btCollisionObject* obj, float volume);
+	double _step_wall_time=0; // total wall clock time spent in stepping the dynamics world in seconds
+	long _number_of_steps=0; // number of calls to stepSimulation
+
+	// class to store information of each separate cnt. the sections of the tube are stored in the flat section arrays below,
+	// from first_section to first_section+number_of_sections-1.
 	struct tube {
-		int number_of_sections;
+		int id=0; // number of the tube in the order that the tubes are added, which is stored in userIndex2 of its sections
+		int first_section=0; // index of the first section of the tube in the section arrays
+		int number_of_sections=0;
 		float diameter=0; // diameter of the tube which is the same for all body objects
 		float length=0;
 		bool isDynamic=true;
 		bool isSaved=false;
-		std::vector<btRigidBody*> bodies; // btRigidBody objects that make the tube
-		std::vector<float> body_length;
-		std::vector<btTypedConstraint*> constraints; // movement constraints that connect the bodies
+		bool isRemoved=false; // the bodies of the tube are released from the world (merged into a static block or removed)
+		btMultiBody* multibody=nullptr; // multibody of a dynamic tube in the multibody tube model, the sections are its link colliders
+		int sleeping_steps=0; // number of steps that all the sections of the dynamic tube have been sleeping
+		std::vector<btRigidBody*> ghosts; // static images of the sections of a frozen tube that are near the edges of a periodic cell
 	};
-	// list to store all the tubes that we will in the simulation
-	std::list<tube> tubes;
+	// tubes in the order that they are added to the simulation. removed tubes at the front of the vector are dropped once
+	// in a while, so the slot of a tube changes, but the order of the tubes does not.
+	std::vector<tube> tubes;
+	int _number_of_added_tubes=0; // total number of tubes that are added, which is the id of the next tube
+
+	// flat arrays holding the data of the sections of all tubes in the same order as the tubes
+	std::vector<btCollisionObject*> _section_bodies; // btRigidBody objects that make the tubes, or the link colliders of a dynamic multibody tube
+	std::vector<float> _body_length; // length of each section
+	std::vector<btTypedConstraint*> _section_constraints; // constraint that connects section i to section i+1 of the same tube, nullptr for the last section of a tube and for frozen tubes
+	std::vector<btMultiBodyConstraint*> _section_joint_limits; // limit of the spherical joint between section i and i+1 of a dynamic multibody tube, nullptr otherwise
+
+	// cursors of the tube lifecycle (dynamic -> frozen -> saved -> removed). these are slots in the tubes vector.
+	int _first_tube=0; // all tubes before this slot are removed
+	int _first_dynamic=0; // all tubes before this slot are frozen. the tubes after it can be frozen out of order with the depth policy.
+	int _number_of_dynamic_tubes=0;
+
+	// freezing policy: "count" only freezes the oldest tubes when there are too many dynamic tubes, "depth" also freezes the tubes that
+	// are buried deep enough below the surface or that have been sleeping for long enough, and "sleeping" also freezes the tubes that
+	// have been sleeping for long enough and saves them as soon as they are frozen (the tubes that are frozen by the cap on the number
+	// of active tubes are saved by save_tubes)
+	std::string _freeze_policy;
+	float _freeze_depth=0; // distance below the reference height of the settled surface at which the top of a tube has to be to get frozen
+	int _freeze_sleeping_steps=0; // number of steps that a tube has to be sleeping to get frozen
+
+	// a section is a candidate for sleeping when its velocities stay below these thresholds for gDeactivationTime
+	float _linear_sleeping_threshold=0, _angular_sleeping_threshold=0;
+	float _deactivation_time=0;
+
+	// highest point of the sections of a tube
+	float tube_top(const tube& t);
+	// the tube is sleeping, or all of its sections are slower than the linear sleeping threshold
+	bool tube_at_rest(const tube& t);
+	int _first_unsaved=0; // all tubes before this slot are saved
+
+	// pools that hold the rigid bodies, motion states and constraints of the tube sections
+	object_pool<btRigidBody> _body_pool;
+	object_pool<btDefaultMotionState> _motion_state_pool;
+	object_pool<btConeTwistConstraint> _constraint_pool;
+
+	// create a rigid body for section number section_index of tube tube_id from the pools and add it to the world
+	btRigidBody* create_section_body(btScalar mass, const btTransform& startTransform, btCollisionShape* shape, int tube_id, int section_index);
+
+	// overlap filter that skips the pairs of neighbor sections of the same tube
+	section_filter_callback _section_filter;
+
+	// the dynamics world seen through its batch removal interface
+	batch_removal* _batch_world=nullptr;
+
+	// remove a set of constraints and collision objects from the world in one pass. the objects are not deleted.
+	void detach_from_world(const std::vector<btTypedConstraint*>& constraints, const std::vector<btCollisionObject*>& objects);
+
+	// create the sections of a tube as the links of a multibody with spherical joints
+	void create_multibody_tube(tube& t, const std::vector<btTransform>& transforms, const std::vector<btCollisionShape*>& shapes, const std::vector<btScalar>& masses);
+
+	// remove the joint limits and the multibody of a tube from the world. the link colliders are left for a batch detach.
+	void detach_multibody(tube& t);
+
+	// delete the multibody and the link colliders of a tube after they are detached from the world
+	void delete_multibody(tube& t);
+
+	// add the cone twist constraints between the neighbor sections of a rigid chain tube
+	void connect_sections(tube& t);
+
+	// make the tubes in the given slots static and delete their constraints
+	void freeze_batch(const std::vector<int>& slots);
+
+	// delete the bodies and constraints of the tubes in the given slots and mark the tubes as removed
+	void release_batch(const std::vector<int>& slots);
+
+	// move _first_tube past the removed tubes and drop the removed tubes from the front of the storage once they take too much space
+	void advance_first_tube();
+
+	// static bodies that each hold the sections of many frozen tubes in a single btCompoundShape
+	std::vector<btRigidBody*> _static_blocks;
+
+	// add a static block with the given compound shape of merged tube sections
+	void add_static_block(btCompoundShape* block_shape);
+
+	// conveyor mode: only a band of tubes below the surface is kept in the world, the tubes below the band are replaced by a static heightfield
+	bool _conveyor=false;
+	float _conveyor_band_depth=0; // depth of the band of tubes that are kept in the world, measured from Ly
+	height_map _floor; // heights of the top of the removed tubes that are used for the heightfield
+	btHeightfieldTerrainShape* _floor_shape=nullptr;
+	btRigidBody* _floor_body=nullptr;
+	std::vector<btRigidBody*> _floor_ghosts; // images of the floor in the neighbor cells of a periodic cell
+
+	// periodic boundaries in x and z: the frozen sections near the edges of the cell get static images on the opposite side of the
+	// cell, and the dynamic tubes whose center leaves the cell are moved back into the cell by one period. the dynamic tubes have no
+	// images, so two dynamic tubes on opposite edges of the cell do not see each other until one of them is frozen.
+	bool _periodic=false;
+
+	// distance from the edges of the cell within which the frozen sections get images. the center of a dynamic tube is always in
+	// the cell, so the tube reaches at most half of its length (plus one section) over the edge.
+	inline float ghost_width() {
+		return _tube_length.back()/2. + _section_length.back() + _tube_diameter.back();
+	};
+
+	// add the static images of the sections of a frozen tube that are near the edges of a periodic cell
+	void add_ghosts(tube& t);
+
+	// move the dynamic tubes whose center left a periodic cell back into the cell
+	void wrap_dynamic_tubes();
+
+	// raise a height map under a section with the given transform and shape
+	void add_to_height_map(height_map& map, const btTransform& trans, const btCollisionShape* shape);
+
+	// recreate the static floor heightfield from _floor
+	void update_floor();
+	// refill the graphics shape of the previous floor with the triangles of the current heightfield
+	void update_floor_graphics_shape(int graphics_shape);
 
 	btVector3 drop_coordinate(); // this method gives the appropriate coordinate for releasing the next tube
+	btVector3 drop_coordinate(const btVector3& ax, float length); // drop coordinate for a tube with axis ax and the given length
+
+	// surface height map of the film, which is updated with the sections of the tubes as they freeze
+	height_map _surface;
+	// the surface height map plus the sections of the dynamic tubes that are at rest. this is rebuilt in get_Ly, so a tube that is
+	// buried under other dynamic tubes is below this surface even before the tubes on top of it freeze.
+	height_map _settled_surface;
+	float _settled_surface_height=0; // reference height of the settled surface, found the same way as _surface_height
+	// reference height of a surface height map as set by the "drop height reference"
+	float reference_height(const height_map& map);
+	bool _height_map_drop=false; // choose the drop site and drop height from the surface height map
+	int _drop_site_candidates=1; // number of random drop sites from which the one with the lowest film under the tube is chosen
+
+	// placement of new tubes by a convex sweep down the drop column instead of a free fall from the drop height
+	bool _sweep_placement=false;
+	float _sweep_clearance=0; // distance above the contact point found by the sweep at which the tube is created
+	float _initial_drop_velocity=0; // downward velocity of the tubes that are placed by the sweep
+
+	// height right above the film at which a tube with the given orientation and size is created
+	btScalar sweep_drop_height(const btVector3& drop_coor, const btQuaternion& qt, float length, float diameter);
+
+	// convert a dynamic body that is detached from the world into a proper static body that is not integrated anymore
+	void make_static(btRigidBody* b);
+
+	// register the graphics instance of a newly created body without walking all the other objects in the world
+	void create_graphics_object(btCollisionObject* obj, const btVector4& color);
+	void create_graphics_object(btCollisionObject* obj);
+
+	// independent random number streams of the deposition process. each stream is seeded from the seed in input.json and the number
+	// of the stream, so a run can be repeated exactly and the streams do not depend on how many numbers the other ones have used.
+	std::uint64_t _random_seed=0;
+	std::mt19937_64 _drop_site_rng; // drop site of the tubes
+	std::mt19937_64 _orientation_rng; // orientation of the tubes in the xz plane
+	std::mt19937_64 _tube_length_rng; // diameter and length of the tubes
+	std::mt19937_64 _section_length_rng; // length of the sections of the tubes
+
+	// seed the random number streams. a negative seed in input.json is replaced by a random one, which is printed so that the run
+	// can be repeated.
+	void seed_random_streams(long long seed);
+
+	// random index in [0, size)
+	inline int random_index(std::mt19937_64& rng, std::size_t size) {
+		return std::uniform_int_distribution<int>(0, int(size)-1)(rng);
+	};
+
+	// random number in [min, max)
+	inline float random_uniform(std::mt19937_64& rng, float min, float max) {
+		return std::uniform_real_distribution<float>(min, max)(rng);
+	};
 
   public:
 	// constructor
 	cnt_mesh(struct GUIHelperInterface* helper, nlohmann::json j): CommonRigidBodyBase(helper) {
-		std::srand(std::time(0)); // use current time as seed for random generator
-		std::cout << "seeded the random number generator!!!" << std::endl;
-
 		_json_prop = j;
 
 		// initialize the output parameters
@@ -75,12 +298,19 @@ struct cnt_mesh : public CommonRigidBodyBase
 		number_of_cnt_output_files = 0;
 	}
 
-	// set the simulation properties according to _json_prop object which is constructed from input.json
-	void parse_json_prop(){
+	// set the simulation properties according to _json_prop object which is constructed from input.json. when a run is resumed,
+	// the output directory is used as it is, since it holds the checkpoint and the output files of the run.
+	void parse_json_prop(bool resume=false){
 		
+		seed_random_streams(_json_prop["random seed"]);
+
 		std::string output_path = _json_prop["output directory"];
 		bool keep_old_files=_json_prop["keep old files"];
-		_output_directory = prepare_directory(output_path, keep_old_files);
+		if (resume) {
+			_output_directory = check_directory(output_path);
+		} else {
+			_output_directory = prepare_directory(output_path, keep_old_files);
+		}
 
 		float container_half_width = float(_json_prop["container width [nm]"])/2.;
 		_half_Lx = container_half_width;
@@ -101,15 +331,134 @@ struct cnt_mesh : public CommonRigidBodyBase
 		}
 
 		drop_height = float(_json_prop["drop height [nm]"]);
+
+		std::string drop_placement = _json_prop["drop placement"];
+		if (drop_placement == "sweep") {
+			_sweep_placement = true;
+		} else if (drop_placement != "free fall") {
+			throw std::invalid_argument("drop placement should be either \"free fall\" or \"sweep\".");
+		}
+		_periodic = _json_prop["periodic boundaries"];
+		// the grid points on the opposite edges of a periodic height map are the same point, which needs a whole number of grid
+		// spacings across the container
+		if (_periodic) {
+			for (std::string key: {"height map grid spacing [nm]", "conveyor grid spacing [nm]"}) {
+				float cells = 2*_half_Lx/float(_json_prop[key]);
+				if (std::abs(cells-std::round(cells)) > 1e-3*cells) {
+					throw std::invalid_argument(key.substr(0, key.find(" ["))+" should divide the container width for periodic boundaries.");
+				}
+			}
+		}
+		_surface = height_map(_half_Lx, _half_Lz, float(_json_prop["height map grid spacing [nm]"]), 0, _periodic);
+		_settled_surface = _surface;
+		std::string drop_site_selection = _json_prop["drop site selection"];
+		if (drop_site_selection == "height map") {
+			_height_map_drop = true;
+		} else if (drop_site_selection != "uniform") {
+			throw std::invalid_argument("drop site selection should be either \"uniform\" or \"height map\".");
+		}
+		_drop_site_candidates = _json_prop["drop site candidates"];
+
+		_drop_height_reference = _json_prop["drop height reference"];
+		if ((_drop_height_reference != "average") and (_drop_height_reference != "percentile") and (_drop_height_reference != "max")) {
+			throw std::invalid_argument("drop height reference should be \"average\", \"percentile\", or \"max\".");
+		}
+		_surface_height_percentile = float(_json_prop["surface height percentile"]);
+
+		_sweep_clearance = float(_json_prop["sweep clearance [nm]"]);
+		_initial_drop_velocity = float(_json_prop["initial drop velocity [nm/s]"]);
+
+		_conveyor = _json_prop["conveyor mode"];
+		_conveyor_band_depth = float(_json_prop["conveyor band depth [nm]"]);
+		_floor = height_map(_half_Lx, _half_Lz, float(_json_prop["conveyor grid spacing [nm]"]), 0, _periodic);
+
+		_adaptive_time_step = _json_prop["adaptive time step"];
+		_min_time_step = float(_json_prop["minimum time step [s]"]);
+		_max_time_step = float(_json_prop["maximum time step [s]"]);
+		_courant_number = float(_json_prop["courant number"]);
+		_max_substeps = _json_prop["maximum substeps"];
+		if (_max_substeps < 1) {
+			throw std::invalid_argument("maximum substeps should be at least 1.");
+		}
+		if (_adaptive_time_step and not ((_min_time_step > 0) and (_min_time_step <= _max_time_step))) {
+			throw std::invalid_argument("the minimum time step should be positive and not larger than the maximum time step.");
+		}
+
+		_multithreaded = _json_prop["multithreaded dynamics world"];
+		_number_of_threads = _json_prop["number of threads"];
+
+		std::string tube_model = _json_prop["tube model"];
+		if (tube_model == "multibody") {
+			_multibody = true;
+		} else if (tube_model != "rigid chain") {
+			throw std::invalid_argument("tube model should be either \"rigid chain\" or \"multibody\".");
+		}
+		if (_multibody and _multithreaded) {
+			throw std::invalid_argument("the multibody tube model can not be used with the multithreaded dynamics world.");
+		}
+
+		_broadphase_type = _json_prop["broadphase"];
+		if ((_broadphase_type != "dbvt") and (_broadphase_type != "axis sweep") and (_broadphase_type != "32 bit axis sweep") and (_broadphase_type != "uniform grid")) {
+			throw std::invalid_argument("broadphase should be \"dbvt\", \"axis sweep\", \"32 bit axis sweep\", or \"uniform grid\".");
+		}
+		_broadphase_height = float(_json_prop["broadphase height [nm]"]);
+		_grid_cell_size = float(_json_prop["uniform grid cell size [nm]"]);
+
+		_freeze_policy = _json_prop["freeze policy"];
+		if ((_freeze_policy != "count") and (_freeze_policy != "depth") and (_freeze_policy != "sleeping")) {
+			throw std::invalid_argument("freeze policy should be \"count\", \"depth\", or \"sleeping\".");
+		}
+		_freeze_depth = float(_json_prop["freeze depth [nm]"]);
+		_freeze_sleeping_steps = _json_prop["freeze sleeping steps"];
+
+		_linear_sleeping_threshold = float(_json_prop["linear sleeping threshold [nm/s]"]);
+		_angular_sleeping_threshold = float(_json_prop["angular sleeping threshold [rad/s]"]);
+		_deactivation_time = float(_json_prop["deactivation time [s]"]);
+		_multibody_swing_limit = float(_json_prop["multibody swing limit [rad]"]);
+
+		_density_band_bottom = float(_json_prop["packing density band [nm]"][0]);
+		_density_band_top = float(_json_prop["packing density band [nm]"][1]);
+		if (_density_band_top <= _density_band_bottom) {
+			throw std::invalid_argument("the top of the packing density band should be above its bottom.");
+		}
+
+		_section_shape = _json_prop["section shape"];
+		if ((_section_shape != "cylinder") and (_section_shape != "capsule") and (_section_shape != "multi sphere")) {
+			throw std::invalid_argument("section shape should be \"cylinder\", \"capsule\", or \"multi sphere\".");
+		}
+
+		// the axis sweep broadphases have a fixed number of handles, and adding more objects than that corrupts them
+		if ((_broadphase_type == "axis sweep") or (_broadphase_type == "32 bit axis sweep")) {
+			_max_number_of_objects = max_number_of_objects();
+			if (_max_number_of_objects < 0) {
+				throw std::invalid_argument("the axis sweep broadphases need a target number of saved tubes to bound the number of objects in the world.");
+			}
+			if ((_broadphase_type == "axis sweep") and (_max_number_of_objects > 32766)) {
+				throw std::invalid_argument("the axis sweep broadphase can hold at most 32766 objects, but there can be " + std::to_string(_max_number_of_objects) + " objects in the world. use the \"32 bit axis sweep\" broadphase.");
+			}
+		}
 	}
 
-	// create all the btCollisionShape that are used to make tubes
+	// create all the btCollisionShape that are used to make tubes. all shapes are aligned with their local y-axis and have the total
+	// length of the section. capsule-capsule contacts are computed analytically, while cylinders go through the general convex
+	// (GJK/EPA) path. the multi sphere shape is the convex hull of two spheres at the ends of the section, which has the same
+	// geometry as the capsule but is collided through the general convex path.
 	void create_tube_colShapes(){
 		btCollisionShape* colShape=nullptr;
 		for (float d: _tube_diameter){
 			_tube_section_collision_shapes.push_back(std::vector<btCollisionShape*>());
 			for (float l: _section_length){
-				colShape = new btCylinderShape(btVector3(d/2.0 ,l/2.0, d/2.0));
+				float r = d/2.0;
+				float h = std::max(float(0), l-d); // distance between the centers of the spherical caps
+				if (_section_shape == "capsule") {
+					colShape = new btCapsuleShape(r, h);
+				} else if (_section_shape == "multi sphere") {
+					btVector3 positions[2] = {btVector3(0,-h/2.0,0), btVector3(0,h/2.0,0)};
+					btScalar radii[2] = {r, r};
+					colShape = new btMultiSphereShape(positions, radii, 2);
+				} else {
+					colShape = new btCylinderShape(btVector3(r ,l/2.0, r));
+				}
 				m_collisionShapes.push_back(colShape);
 				_tube_section_collision_shapes.back().push_back(colShape);
 			}
@@ -118,17 +467,80 @@ struct cnt_mesh : public CommonRigidBodyBase
 		std::cout << "new collision shape created!" << std::endl;
 	}
 
+	// use the collision shapes of the tube sections of another cnt_mesh with the same tube and section properties. the shapes are
+	// only read by the collision detection, so several worlds can use them from different threads. they are not added to
+	// m_collisionShapes, so they stay owned (and are deleted) by the other object, which has to outlive this one.
+	void share_tube_colShapes(const cnt_mesh& other){
+		_tube_section_collision_shapes = other._tube_section_collision_shapes;
+	}
+
 	void initPhysics();
+
+	// destroy the pooled tube sections and then the rest of the objects in the world
+	virtual void exitPhysics();
+
+	// create the dynamics world, either the sequential, the multithreaded, or the multibody one, with batch removal
+	virtual void createEmptyDynamicsWorld();
 	void renderScene();
 	
 	void resetCamera();
 
-	inline void stepSimulation(float deltaTime) {
-		if (m_dynamicsWorld)
-		{
-			m_dynamicsWorld->stepSimulation(deltaTime,10,deltaTime);
-		}
-	}
+	// step the simulation with a fixed time step, or with an adaptive time step if it is turned on in input.json
+	void stepSimulation(float deltaTime);
+
+	// total number of internal simulation steps that are taken by the dynamics world
+	inline const long& number_of_substeps() {
+		return _number_of_substeps;
+	};
+
+	// total simulated time
+	inline const double& simulated_time() {
+		return _simulated_time;
+	};
+
+	// number of steps since the last batch of tubes was added. it is kept in the checkpoint, so a resumed run adds its next batch
+	// after the same number of steps as the stopped run.
+	inline int& steps_since_last_batch() {
+		return _steps_since_last_batch;
+	};
+
+	// average wall clock time of one call to stepSimulation in seconds
+	inline double mean_step_time() {
+		return (_number_of_steps == 0) ? 0 : _step_wall_time/_number_of_steps;
+	};
+
+	// average wall clock time that the broadphase takes in one call to stepSimulation in seconds
+	inline double mean_broadphase_time() {
+		return (_number_of_steps == 0) ? 0 : _broadphase_timer->broadphase_time/_number_of_steps;
+	};
+
+	// number of pairs of objects whose aabbs overlap
+	inline int number_of_overlapping_pairs() {
+		return m_dynamicsWorld->getPairCache()->getNumOverlappingPairs();
+	};
+
+	// fraction of the height band of the packing density that is filled by the frozen tubes
+	inline double packing_density() {
+		return _density_band_volume/(4.*_half_Lx*_half_Lz*(_density_band_top-_density_band_bottom));
+	};
+
+	// update the maximum velocity and the kinetic energy of the sections of the dynamic tubes, and count their sleeping steps
+	void update_active_velocity();
+
+	// maximum linear velocity of the sections of the dynamic tubes
+	inline const float& max_active_velocity() {
+		return _max_active_velocity;
+	};
+
+	// total kinetic energy of the sections of the dynamic tubes
+	inline const float& active_kinetic_energy() {
+		return _active_kinetic_energy;
+	};
+
+	// path of the output directory
+	inline const std::experimental::filesystem::path& output_directory() {
+		return _output_directory.path();
+	};
 
 	// set and save the json properties that is read and parsed from the input_json file.
 	void save_json_properties(nlohmann::json j);
@@ -144,33 +556,73 @@ struct cnt_mesh : public CommonRigidBodyBase
 
 	// gets the number of tubes in the simulation
 	inline int num_tubes() {
-		return tubes.size();
+		return tubes.size()-_first_tube;
 	}
 
-	// make tubes static in the simulation and only leave _number_of_active_tubes as dynamic in the simulation.
+	// make tubes static in the simulation according to the freeze policy, and only leave at most number_of_active_tubes as dynamic.
 	void freeze_tubes(unsigned number_of_active_tubes);
 
 	// remove the tubes from the simulation and only leave _max_number_of_tubes in the simulation
 	void remove_tubes(unsigned max_number_of_tubes);
 
+	// merge the oldest frozen and saved tubes into static compound blocks of number_of_tubes_per_block tubes
+	void merge_tubes(unsigned number_of_tubes_per_block);
+
+	// in conveyor mode, replace the frozen and saved tubes that are below the band of active tubes with a static heightfield
+	void convey_tubes();
+
+	// gets the number of static blocks of merged tubes
+	inline int num_static_blocks() {
+		return _static_blocks.size();
+	}
+
 	// save the coordinates of the tube to an output file.
 	void save_one_tube(tube &t);
 
-	// update Ly, which is roughly the height of the filled container
+	// update Ly, the reference height of the surface, and the settled surface
 	void get_Ly();
 
-	// read Ly, which is roughly the height of the filled container
+	// read Ly, which is the mean height of the frozen tubes. it lags behind the film while the newest tubes are still dynamic.
 	inline const float& read_Ly() {
 		return Ly;
 	};
+
+	// mean height of the film including the dynamic tubes at rest, which is the height of the film for the stop criterion and the
+	// status line. unlike Ly, this grows from the first batch on and does not wait for the tubes to freeze.
+	inline float read_film_height() {
+		return _settled_surface.mean_height();
+	};
+
+	// read the reference height of the surface that is used for dropping new tubes
+	inline const float& read_surface_height() {
+		return _surface_height;
+	};
+
+	// highest point of the surface of the film
+	inline float read_max_height() {
+		return _surface.max_height();
+	};
 	
 	// get number of saved tubes
 	inline const int& no_of_saved_tubes() {
 		return number_of_saved_tubes;
 	};
 
+	// save the frozen tubes and only leave number_of_unsaved_tubes of the newest tubes unsaved
 	void save_tubes(int number_of_unsaved_tubes);
 
+	// freeze all the dynamic tubes and save all the tubes that are not saved yet, which is done when a run stops
+	void flush_tubes();
+
+	// write a checkpoint of the simulation into the output directory. checkpoint.cbor holds the state of the tubes, the counters and
+	// the random streams, but not the contact manifolds or the warm starting impulses of the solver, so a resumed run is close to the
+	// stopped one but not the same step by step
+	void save_checkpoint();
+
+	// continue a run from the checkpoint in the output directory. the world has to be initialized with the container and the
+	// collision shapes of the tube sections, and without any tubes.
+	void load_checkpoint();
+
 };
 
 
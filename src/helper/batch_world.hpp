@@ -0,0 +1,164 @@
+#ifndef _batch_world_hpp_
+#define _batch_world_hpp_
+
+#include <vector>
+#include <unordered_set>
+#include <utility>
+
+#include "btBulletDynamicsCommon.h"
+#include "BulletCollision/BroadphaseCollision/btOverlappingPairCache.h"
+
+// interface for removing many constraints and collision objects from a dynamics world at once
+class batch_removal
+{
+public:
+  virtual ~batch_removal() {};
+
+  // remove a set of constraints from the world. the constraints are not deleted.
+  virtual void remove_constraints(const std::vector<btTypedConstraint*>& constraints) = 0;
+
+  // remove a set of collision objects (rigid bodies or multibody link colliders) from the world. the objects are not deleted and
+  // their constraints have to be removed already.
+  virtual void remove_collision_objects(const std::vector<btCollisionObject*>& objects) = 0;
+};
+
+// broadphase whose overlapping pair cache can be swapped out. while the proxies of a batch of objects are destroyed, a null pair
+// cache is swapped in, because the overlapping pairs of these objects are already removed in one walk over the real pair cache.
+class pair_cache_swap
+{
+public:
+  virtual ~pair_cache_swap() {};
+
+  // use the given pair cache and return the one that was used before
+  virtual btOverlappingPairCache* swap_pair_cache(btOverlappingPairCache* pair_cache) = 0;
+};
+
+// axis sweep broadphase (btAxisSweep3 or bt32BitAxisSweep3) whose pair cache can be swapped out. the pair cache of the axis sweep
+// is a protected member, so it is only reachable from a derived class.
+template <class sweep_t>
+class batch_axis_sweep : public sweep_t, public pair_cache_swap
+{
+public:
+  using sweep_t::sweep_t;
+
+  btOverlappingPairCache* swap_pair_cache(btOverlappingPairCache* pair_cache) override
+  {
+    std::swap(this->m_pairCache, pair_cache);
+    return pair_cache;
+  };
+};
+
+// dynamics world that can remove a set of constraints and collision objects in one pass over its internal arrays.
+// removeConstraint and removeRigidBody do a linear search of the constraint and non-static body arrays for each object, and each
+// broadphase proxy that is destroyed walks the whole overlapping pair cache, so removing n objects one by one is O(n^2).
+// here the arrays are compacted once, the overlapping pairs of all the objects are removed in one walk over the pair cache, and the
+// proxies are destroyed without touching the pair cache again.
+template <class world_t>
+class batch_world : public world_t, public batch_removal
+{
+  // removes the overlapping pairs that contain any of the given objects
+  struct remove_pairs_callback : public btOverlapCallback
+  {
+    const std::unordered_set<const void*>& objects;
+
+    remove_pairs_callback(const std::unordered_set<const void*>& objects_) : objects(objects_) {};
+
+    bool processOverlap(btBroadphasePair& pair) override
+    {
+      return objects.count(pair.m_pProxy0->m_clientObject) or objects.count(pair.m_pProxy1->m_clientObject);
+    };
+  };
+
+public:
+  template <class... Args>
+  batch_world(Args&&... args) : world_t(std::forward<Args>(args)...) {};
+
+  void remove_constraints(const std::vector<btTypedConstraint*>& constraints) override
+  {
+    if (constraints.empty())
+      return;
+
+    std::unordered_set<const btTypedConstraint*> removed(constraints.begin(), constraints.end());
+    for (auto& c: constraints)
+    {
+      c->getRigidBodyA().removeConstraintRef(c);
+      c->getRigidBodyB().removeConstraintRef(c);
+    }
+
+    int j = 0;
+    for (int i=0; i<this->m_constraints.size(); ++i)
+    {
+      if (not removed.count(this->m_constraints[i]))
+        this->m_constraints[j++] = this->m_constraints[i];
+    }
+    this->m_constraints.resize(j);
+  };
+
+  void remove_collision_objects(const std::vector<btCollisionObject*>& objects) override
+  {
+    if (objects.empty())
+      return;
+
+    std::unordered_set<const void*> removed(objects.begin(), objects.end());
+
+    // remove all the overlapping pairs of the objects (and their contact manifolds) in one walk over the pair cache
+    btBroadphaseInterface* broadphase = this->getBroadphase();
+    btDispatcher* dispatcher = this->getDispatcher();
+    remove_pairs_callback callback(removed);
+    broadphase->getOverlappingPairCache()->processAllOverlappingPairs(&callback, dispatcher);
+
+    // the broadphases search the pair cache again for every proxy that is destroyed. there are no pairs left for these proxies, so
+    // a null pair cache is swapped in while they are destroyed. the dbvt broadphase has a public pair cache, and the other
+    // broadphases of the film (the axis sweeps and the uniform grid) implement pair_cache_swap.
+    btDbvtBroadphase* dbvt = dynamic_cast<btDbvtBroadphase*>(broadphase);
+    pair_cache_swap* swap = dynamic_cast<pair_cache_swap*>(broadphase);
+    btNullPairCache null_pair_cache;
+    btOverlappingPairCache* pair_cache = nullptr;
+    if (dbvt)
+    {
+      pair_cache = dbvt->m_paircache;
+      dbvt->m_paircache = &null_pair_cache;
+    }
+    else if (swap)
+    {
+      pair_cache = swap->swap_pair_cache(&null_pair_cache);
+    }
+    for (auto& obj: objects)
+    {
+      if (obj->getBroadphaseHandle())
+      {
+        broadphase->destroyProxy(obj->getBroadphaseHandle(), dispatcher);
+        obj->setBroadphaseHandle(0);
+      }
+    }
+    if (dbvt)
+      dbvt->m_paircache = pair_cache;
+    else if (swap)
+      swap->swap_pair_cache(pair_cache);
+
+    // compact the arrays of the world and fix the array index of the objects that are left
+    int j = 0;
+    for (int i=0; i<this->m_nonStaticRigidBodies.size(); ++i)
+    {
+      if (not removed.count(this->m_nonStaticRigidBodies[i]))
+        this->m_nonStaticRigidBodies[j++] = this->m_nonStaticRigidBodies[i];
+    }
+    this->m_nonStaticRigidBodies.resize(j);
+
+    j = 0;
+    for (int i=0; i<this->m_collisionObjects.size(); ++i)
+    {
+      btCollisionObject* obj = this->m_collisionObjects[i];
+      if (removed.count(obj))
+      {
+        obj->setWorldArrayIndex(-1);
+        continue;
+      }
+      obj->setWorldArrayIndex(j);
+      this->m_collisionObjects[j++] = obj;
+    }
+    this->m_collisionObjects.resize(j);
+  };
+};
+
+#endif //_batch_world_hpp_
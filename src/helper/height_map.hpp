@@ -0,0 +1,194 @@
+#ifndef _height_map_hpp_
+#define _height_map_hpp_
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// 2d map of heights over the xz plane of the container, sampled on a regular grid of points.
+// the grid spans [-half_Lx, half_Lx] x [-half_Lz, half_Lz], and coordinates outside of it are clamped to the edge of the grid, or
+// wrapped around into the grid for a periodic map.
+struct height_map
+{
+  float half_Lx=0, half_Lz=0; // half size of the area covered by the map
+  float spacing=1; // distance between the grid points
+  bool periodic=false; // the map repeats itself in x and z with the periods 2*half_Lx and 2*half_Lz
+  int nx=0, nz=0; // number of grid points in x and z direction
+  std::vector<float> heights; // height of the grid point (ix,iz) is stored at heights[iz*nx+ix]
+
+  // running aggregates of the heights that are updated whenever a height changes, so that the statistics of the map are
+  // available without scanning all the grid points.
+  double sum_of_heights=0; // sum of the heights of all grid points
+  float highest=0; // height of the highest grid point
+  std::vector<int> histogram; // number of grid points in each height bin. the bin width is the same as the grid spacing.
+
+  height_map() {};
+
+  height_map(float half_Lx_, float half_Lz_, float spacing_, float initial_height=0, bool periodic_=false)
+  {
+    half_Lx = half_Lx_;
+    half_Lz = half_Lz_;
+    spacing = spacing_;
+    periodic = periodic_;
+    // the spacing of a periodic map divides the period, so the number of cells is rounded instead of rounded up, which would add
+    // a cell for a tiny rounding error
+    if (periodic)
+    {
+      nx = int(std::lround(2*half_Lx/spacing))+1;
+      nz = int(std::lround(2*half_Lz/spacing))+1;
+    }
+    else
+    {
+      nx = int(std::ceil(2*half_Lx/spacing))+1;
+      nz = int(std::ceil(2*half_Lz/spacing))+1;
+    }
+    heights.assign(nx*nz, initial_height);
+
+    sum_of_heights = double(initial_height)*heights.size();
+    highest = initial_height;
+    histogram.assign(bin(initial_height)+1, 0);
+    histogram[bin(initial_height)] = heights.size();
+  };
+
+  // index of the histogram bin of a height
+  inline int bin(float h) const
+  {
+    return std::max(0, int(h/spacing));
+  };
+
+  // change the height of the grid point with index i and update the running aggregates
+  inline void set_height(int i, float h)
+  {
+    histogram[bin(heights[i])]--;
+    sum_of_heights += h - heights[i];
+    heights[i] = h;
+    highest = std::max(highest, h);
+    if (bin(h) >= int(histogram.size()))
+      histogram.resize(bin(h)+1, 0);
+    histogram[bin(h)]++;
+  };
+
+  // the coordinate x moved by a whole number of periods 2*half into [-half, half)
+  static inline float wrap(float x, float half)
+  {
+    return x - 2*half*std::floor((x+half)/(2*half));
+  };
+
+  // index of the grid point closest to x
+  inline int ix(float x) const
+  {
+    if (periodic)
+      x = wrap(x, half_Lx);
+    return std::clamp(int(std::lround((x+half_Lx)/spacing)), 0, nx-1);
+  };
+
+  // index of the grid point closest to z
+  inline int iz(float z) const
+  {
+    if (periodic)
+      z = wrap(z, half_Lz);
+    return std::clamp(int(std::lround((z+half_Lz)/spacing)), 0, nz-1);
+  };
+
+  // raise the grid point with index i to the height h if it is lower. the grid points on the opposite edges of a periodic map are
+  // the same point, so they are raised together. this needs a spacing that divides the period, which parse_json_prop checks.
+  inline void raise(int i, float h)
+  {
+    int ix_ = i%nx, iz_ = i/nx;
+    int twin_ix = ix_, twin_iz = iz_;
+    if (periodic)
+    {
+      twin_ix = (ix_ == 0) ? nx-1 : ((ix_ == nx-1) ? 0 : ix_);
+      twin_iz = (iz_ == 0) ? nz-1 : ((iz_ == nz-1) ? 0 : iz_);
+    }
+
+    const int points[4] = {i, iz_*nx+twin_ix, twin_iz*nx+ix_, twin_iz*nx+twin_ix};
+    for (int k=0; k<4; ++k)
+    {
+      if (h > heights[points[k]])
+        set_height(points[k], h);
+    }
+  };
+
+  // index of the grid point closest to (x,z) in the heights vector
+  inline int index(float x, float z) const
+  {
+    return iz(z)*nx + ix(x);
+  };
+
+  // coordinates of the grid point (ix,iz)
+  inline float x(int ix) const
+  {
+    return -half_Lx + ix*spacing;
+  };
+
+  inline float z(int iz) const
+  {
+    return -half_Lz + iz*spacing;
+  };
+
+  inline float height(float x, float z) const
+  {
+    return heights[index(x,z)];
+  };
+
+  // raise the grid points below a segment from (x0,y0,z0) to (x1,y1,z1) up to the top of a tube with the given radius
+  void add_segment(float x0, float y0, float z0, float x1, float y1, float z1, float radius)
+  {
+    float length = std::hypot(x1-x0, z1-z0);
+    int n = int(std::ceil(2*length/spacing)); // sample the segment at every half grid spacing
+    for (int k=0; k<=n; ++k)
+    {
+      float t = (n==0) ? 0 : float(k)/float(n);
+      raise(index(x0+t*(x1-x0), z0+t*(z1-z0)), y0+t*(y1-y0)+radius);
+    }
+  };
+
+  // highest point of the map below a segment from (x0,z0) to (x1,z1)
+  float max_along_segment(float x0, float z0, float x1, float z1) const
+  {
+    float length = std::hypot(x1-x0, z1-z0);
+    int n = int(std::ceil(2*length/spacing));
+    float max_height = heights[index(x0,z0)];
+    for (int k=1; k<=n; ++k)
+    {
+      float t = float(k)/float(n);
+      max_height = std::max(max_height, heights[index(x0+t*(x1-x0), z0+t*(z1-z0))]);
+    }
+    return max_height;
+  };
+
+  // the lowest and the highest point of the map
+  inline float min_height() const
+  {
+    return *std::min_element(heights.begin(), heights.end());
+  };
+
+  inline float max_height() const
+  {
+    return highest;
+  };
+
+  // average height of the map
+  inline float mean_height() const
+  {
+    return heights.empty() ? 0 : float(sum_of_heights/heights.size());
+  };
+
+  // height below which the given fraction of the grid points are. the histogram is walked down from the top, which only
+  // takes a few bins because the surface of the film is not very rough.
+  float percentile_height(float fraction) const
+  {
+    int number_above = int((1-fraction)*heights.size());
+    int count = 0;
+    for (int b=int(histogram.size())-1; b>=0; --b)
+    {
+      count += histogram[b];
+      if (count > number_above)
+        return std::min(highest, (b+1)*spacing);
+    }
+    return 0;
+  };
+};
+
+#endif //_height_map_hpp_
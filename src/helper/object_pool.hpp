@@ -0,0 +1,94 @@
+#ifndef _object_pool_hpp_
+#define _object_pool_hpp_
+
+#include <vector>
+#include <new>
+#include <utility>
+
+#include "LinearMath/btAlignedAllocator.h"
+
+// pool of objects of type T that are allocated in large chunks of 16-byte aligned memory (which is what bullet objects need).
+// destroyed objects are kept in a free list and their memory is reused by the next objects that are created, so creating and
+// destroying objects does not go through the heap allocator, and objects that are created one after another are next to each
+// other in memory. the chunks are only given back to the system when the pool is destroyed.
+template <class T>
+class object_pool
+{
+  int _chunk_size; // number of objects in each chunk
+  std::vector<void*> _chunks; // memory chunks
+  int _used_in_last_chunk; // number of objects that are already handed out from the last chunk
+  std::vector<T*> _free; // objects that are destroyed and whose memory can be reused
+  int _number_of_objects=0; // number of objects that are alive
+
+public:
+  object_pool(int chunk_size=4096)
+  {
+    _chunk_size = chunk_size;
+    _used_in_last_chunk = chunk_size;
+  };
+
+  // the objects have to be destroyed before the pool is destroyed
+  ~object_pool()
+  {
+    for (auto& c: _chunks)
+    {
+      btAlignedFree(c);
+    }
+  };
+
+  object_pool(const object_pool&) = delete;
+  object_pool& operator=(const object_pool&) = delete;
+
+  // construct a new object in the pool
+  template <class... Args>
+  T* create(Args&&... args)
+  {
+    void* memory;
+    if (not _free.empty())
+    {
+      memory = _free.back();
+      _free.pop_back();
+    }
+    else
+    {
+      if (_used_in_last_chunk == _chunk_size)
+      {
+        _chunks.push_back(btAlignedAlloc(sizeof(T)*_chunk_size, 16));
+        _used_in_last_chunk = 0;
+      }
+      memory = static_cast<T*>(_chunks.back()) + _used_in_last_chunk;
+      _used_in_last_chunk++;
+    }
+    _number_of_objects++;
+    return ::new (memory) T(std::forward<Args>(args)...);
+  };
+
+  // destroy an object that is created by this pool and keep its memory for the next objects
+  void destroy(T* obj)
+  {
+    if (obj == nullptr)
+      return;
+    obj->~T();
+    _free.push_back(obj);
+    _number_of_objects--;
+  };
+
+  // destroy a batch of objects at once
+  template <class Iterator>
+  void destroy(Iterator first, Iterator last)
+  {
+    _free.reserve(_free.size() + (last-first));
+    for (Iterator it=first; it!=last; ++it)
+    {
+      destroy(*it);
+    }
+  };
+
+  // number of objects that are alive
+  inline int size() const
+  {
+    return _number_of_objects;
+  };
+};
+
+#endif //_object_pool_hpp_
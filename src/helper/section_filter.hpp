@@ -0,0 +1,46 @@
+#ifndef _section_filter_hpp_
+#define _section_filter_hpp_
+
+#include <cstdlib>
+
+#include "btBulletDynamicsCommon.h"
+
+//preprocessor function define
+#define BIT(x)	(1<<(x))
+
+// collision groups of the objects in the world. the frozen group is the same bit as btBroadphaseProxy::StaticFilter, so the
+// static bodies that are added with the default group (container, static blocks, and floor) are treated as frozen sections.
+enum collisionTypes
+{
+  COL_NOTHING = 0, // collide with nothing
+  COL_TUBE = BIT(0), // sections of the dynamic tubes
+  COL_FROZEN = BIT(1), // sections of the frozen tubes and other static objects
+  COL_EVERYTHING = -1 // collide with everything
+};
+
+// overlap filter that applies the group/mask filtering, and also rejects the pairs of neighbor sections of the same tube, which are
+// always touching at their joint. the sections of a tube have the number of the tube in userIndex2 and the index of the section in
+// the tube in userIndex3. the rejected pairs never make it to the pair cache, so no contact manifolds are made for them.
+struct section_filter_callback : public btOverlapFilterCallback
+{
+  bool needBroadphaseCollision(btBroadphaseProxy* proxy0, btBroadphaseProxy* proxy1) const override
+  {
+    bool collides = (proxy0->m_collisionFilterGroup & proxy1->m_collisionFilterMask) != 0;
+    collides = collides && (proxy1->m_collisionFilterGroup & proxy0->m_collisionFilterMask);
+    if (not collides)
+      return false;
+
+    const btCollisionObject* obj0 = static_cast<const btCollisionObject*>(proxy0->m_clientObject);
+    const btCollisionObject* obj1 = static_cast<const btCollisionObject*>(proxy1->m_clientObject);
+
+    if ((obj0->getUserIndex2() >= 0) and (obj0->getUserIndex2() == obj1->getUserIndex2()))
+    {
+      if (std::abs(obj0->getUserIndex3() - obj1->getUserIndex3()) == 1)
+        return false;
+    }
+
+    return true;
+  };
+};
+
+#endif //_section_filter_hpp_
@@ -0,0 +1,64 @@
+#ifndef _timed_world_hpp_
+#define _timed_world_hpp_
+
+#include <chrono>
+#include <utility>
+
+#include "LinearMath/btScalar.h"
+
+// interface for reading the time that a dynamics world spends in the broadphase
+class broadphase_timer
+{
+public:
+  double broadphase_time=0; // total wall clock time spent in updating the aabbs and finding the overlapping pairs in seconds
+
+  virtual ~broadphase_timer() {};
+};
+
+// interface for reading and setting the time that a dynamics world carries over to its next step. bullet only takes whole fixed
+// substeps, and the rest of the time step is added to the next one.
+class step_clock
+{
+public:
+  virtual ~step_clock() {};
+
+  virtual btScalar local_time() const = 0;
+  virtual void set_local_time(btScalar t) = 0;
+};
+
+// dynamics world that measures the time of its broadphase, which is the update of the aabbs of the moving objects in the
+// broadphase and the search for the new overlapping pairs. it also lets the time that is carried over to the next step be read and
+// set, so that it can be kept in a checkpoint.
+template <class world_t>
+class timed_world : public world_t, public broadphase_timer, public step_clock
+{
+public:
+  template <class... Args>
+  timed_world(Args&&... args) : world_t(std::forward<Args>(args)...) {};
+
+  void updateAabbs() override
+  {
+    auto start = std::chrono::steady_clock::now();
+    world_t::updateAabbs();
+    broadphase_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+  };
+
+  void computeOverlappingPairs() override
+  {
+    auto start = std::chrono::steady_clock::now();
+    world_t::computeOverlappingPairs();
+    broadphase_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+  };
+
+  btScalar local_time() const override
+  {
+    return this->m_localTime;
+  };
+
+  void set_local_time(btScalar t) override
+  {
+    this->m_localTime = t;
+  };
+};
+
+#endif //_timed_world_hpp_
@@ -2,6 +2,16 @@
 #include <iostream>
 #include <ctime>
 #include <array>
+#include <string>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <experimental/filesystem>
 
 #include "../misc_files/CommonInterfaces/CommonExampleInterface.h"
 #include "../misc_files/CommonInterfaces/CommonGUIHelperInterface.h"
@@ -47,6 +57,287 @@ static void OnMouseDown(int button, int state, float x, float y) {
 }
 //*************************************************************************************************
 
+// set by the handler of SIGINT and SIGTERM. the films stop at their next step, write a checkpoint, and save their remaining tubes.
+volatile std::sig_atomic_t stop_signal = 0;
+
+static void handle_stop_signal(int signal) {
+	stop_signal = signal;
+}
+
+// start of the run, which the wall clock budget is measured from
+std::chrono::steady_clock::time_point run_start_time = std::chrono::steady_clock::now();
+
+// wall clock time since the start of the run in seconds
+double run_wall_time() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now()-run_start_time).count();
+}
+
+// properties of the deposition loop that are read from input.json
+struct deposition_properties {
+	int number_of_tubes_added_together;
+	int number_of_active_tubes;
+	int number_of_tubes_before_deletion;
+	int number_of_unsaved_tubes;
+	int number_of_tubes_per_static_block;
+
+	// the next batch of tubes is added once the active tubes have settled, or after a timeout if they don't.
+	float settle_velocity_threshold;
+	float settle_kinetic_energy_threshold;
+	int settle_minimum_steps;
+	int settle_timeout_steps;
+
+	// stop criteria of a film, 0 turns a criterion off. without any of them the film grows until the run gets a stop signal.
+	int target_number_of_saved_tubes; // the film is finished once this many tubes are saved
+	float target_film_height; // the film is finished once its average height reaches this
+	double wall_clock_budget; // the run stops once it has taken this much wall clock time in seconds
+
+	double checkpoint_interval; // wall clock time between the checkpoints in seconds, 0 turns the checkpoints off
+};
+
+// what a film did in one run, for the throughput report
+struct deposition_summary {
+	std::string stop_reason;
+	int saved_tubes=0; // number of tubes that are saved in this run, including the ones that are saved when the film stops
+	long substeps=0; // number of internal steps of the dynamics world in this run
+	double simulated_time=0; // simulated time in this run in seconds
+	double wall_time=0; // wall clock time of this run in seconds
+};
+
+deposition_properties read_deposition_properties(nlohmann::json& j) {
+	deposition_properties p;
+	p.number_of_tubes_added_together = j["number of tubes added together"];
+	p.number_of_active_tubes = j["number of active tubes"];
+	p.number_of_tubes_before_deletion = j["number of tubes before deletion"];
+	p.number_of_unsaved_tubes = j["number of unsaved tubes"];
+	p.number_of_tubes_per_static_block = j["number of tubes per static block"];
+
+	p.settle_velocity_threshold = j["settle velocity threshold [nm/s]"];
+	p.settle_kinetic_energy_threshold = j["settle kinetic energy threshold"];
+	p.settle_minimum_steps = j["settle minimum steps"];
+	p.settle_timeout_steps = j["settle timeout [steps]"];
+
+	p.target_number_of_saved_tubes = j["target number of saved tubes"];
+	p.target_film_height = j["target film height [nm]"];
+	p.wall_clock_budget = j["wall clock budget [s]"];
+	p.checkpoint_interval = j["checkpoint interval [s]"];
+	return p;
+}
+
+// the reason to stop the deposition of a film, or an empty string if the film should keep growing
+std::string stop_reason(cnt_mesh* film, const deposition_properties& p) {
+	if (stop_signal)
+		return "stop signal";
+	if ((p.target_number_of_saved_tubes > 0) and (film->no_of_saved_tubes() >= p.target_number_of_saved_tubes))
+		return "target number of saved tubes";
+	if ((p.target_film_height > 0) and (film->read_film_height() >= p.target_film_height))
+		return "target film height";
+	if ((p.wall_clock_budget > 0) and (run_wall_time() >= p.wall_clock_budget))
+		return "wall clock budget";
+	return "";
+}
+
+// print how fast the film grew in this run
+void print_throughput(const deposition_summary& s) {
+	double hours = s.wall_time/3600.;
+	std::cout << "stopped by: " << s.stop_reason << ",  saved tubes: " << s.saved_tubes << ",  wall time [s]: " << s.wall_time
+	          << ",  saved tubes per hour: " << ((hours > 0) ? s.saved_tubes/hours : 0)
+	          << ",  simulation steps per second: " << ((s.wall_time > 0) ? s.substeps/s.wall_time : 0)
+	          << ",  simulated time per wall time: " << ((s.wall_time > 0) ? s.simulated_time/s.wall_time : 0) << std::endl;
+}
+
+// drop batches of tubes into the film until one of the stop criteria is met. after each batch the status line is printed if
+// print_status is set, and after_batch is called (e.g. to render the scene). the number of steps since the last batch is kept by the
+// film and stored in its checkpoints, so a resumed run adds its next batch after the same number of steps. when the film stops, a
+// last checkpoint is written (if the checkpoints are on) before all the remaining tubes are frozen and saved, so a resumed run cuts
+// these tubes off the output files and continues from the stopped state. the contacts are built up again after the resume, so the
+// resumed run is close to the stopped one but not the same step by step.
+deposition_summary deposit_film(cnt_mesh* film, const deposition_properties& p, bool print_status, const std::function<void()>& after_batch) {
+	int& steps_since_last_batch = film->steps_since_last_batch();
+	auto start = std::chrono::steady_clock::now();
+	auto last_checkpoint = start;
+
+	deposition_summary summary;
+	int initial_saved_tubes = film->no_of_saved_tubes();
+	long initial_substeps = film->number_of_substeps();
+	double initial_simulated_time = film->simulated_time();
+
+	while((summary.stop_reason = stop_reason(film, p)).empty())
+	{
+		steps_since_last_batch ++;
+	
+		btScalar dtSec = 0.05;
+		// btScalar dtSec = 0.01;
+		film->stepSimulation(dtSec);
+
+		// the active tubes are settled when they are slow enough. the minimum number of steps is needed because
+		// a newly added tube starts at rest before it falls.
+		bool settled = (steps_since_last_batch >= p.settle_minimum_steps) and
+		               ((film->max_active_velocity() < p.settle_velocity_threshold) or
+		                (film->active_kinetic_energy() < p.settle_kinetic_energy_threshold));
+
+		if (settled or (steps_since_last_batch >= p.settle_timeout_steps)) // add new tubes once the previous ones have landed.
+		{	
+			steps_since_last_batch = 0;
+
+			film->get_Ly();
+
+			// add this many cnt's at a time
+			for (int i=0; i<p.number_of_tubes_added_together; i++)
+			{
+				film->add_tube_in_xz();
+			}
+			film->save_tubes(p.number_of_unsaved_tubes);
+			film->freeze_tubes(p.number_of_active_tubes); // keep only this many of tubes active (for example 100) and freeze the rest of the tubes
+			film->merge_tubes(p.number_of_tubes_per_static_block); // merge the frozen and saved tubes into large static blocks (0 turns this off)
+			film->convey_tubes(); // in conveyor mode, replace the tubes below the band of active tubes with a static heightfield
+			// film->remove_tubes(p.number_of_tubes_before_deletion); // keep only this many of tubes in the simulation (for example 400) and delete the rest of objects
+			
+			if (print_status)
+			{
+				std::cout << "number of saved tubes: " << film->no_of_saved_tubes() << ",  height [nm]:" << film->read_film_height() << ",  simulation steps: " << film->number_of_substeps()
+				          << ",  step time [ms]: " << 1000*film->mean_step_time() << ",  broadphase time [ms]: " << 1000*film->mean_broadphase_time()
+				          << ",  overlapping pairs: " << film->number_of_overlapping_pairs() << ",  packing density: " << film->packing_density() << "      \r" << std::flush;
+			}
+
+			after_batch();
+
+			if ((p.checkpoint_interval > 0) and (std::chrono::duration<double>(std::chrono::steady_clock::now()-last_checkpoint).count() >= p.checkpoint_interval))
+			{
+				film->save_checkpoint();
+				last_checkpoint = std::chrono::steady_clock::now();
+			}
+		}
+	}
+
+	if (print_status)
+	{
+		std::cout << std::endl;
+	}
+
+	if (p.checkpoint_interval > 0)
+	{
+		film->save_checkpoint();
+	}
+	film->flush_tubes();
+
+	summary.saved_tubes = film->no_of_saved_tubes()-initial_saved_tubes;
+	summary.substeps = film->number_of_substeps()-initial_substeps;
+	summary.simulated_time = film->simulated_time()-initial_simulated_time;
+	summary.wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+	return summary;
+}
+
+// run an ensemble of independent films with different seeds in this process, with one headless world per worker thread. the film
+// number i uses the seed (random seed + i) and writes into the directory seed_<seed> inside the output directory. the collision
+// shapes of the tube sections are made once and shared by all the films. when the ensemble is resumed, the films that have a
+// checkpoint continue from it and the others start over.
+void run_ensemble(nlohmann::json j, bool resume) {
+	namespace fs = std::experimental::filesystem;
+
+	int ensemble_size = j["ensemble size"];
+	int number_of_workers = j["ensemble threads"];
+	if (number_of_workers <= 0) {
+		number_of_workers = std::thread::hardware_concurrency();
+	}
+	number_of_workers = std::max(1, std::min(number_of_workers, ensemble_size));
+
+	// the seeds of the films of a resumed ensemble are the ones in the input.json that is saved in its output directory
+	if (resume) {
+		std::ifstream saved_input_file((check_directory(j["output directory"].get<std::string>()).path() / "input.json").c_str());
+		nlohmann::json saved_j;
+		saved_input_file >> saved_j;
+		j["random seed"] = saved_j["random seed"];
+	}
+
+	long long base_seed = j["random seed"];
+	if (base_seed < 0) {
+		base_seed = std::random_device{}() & 0x7fffffff;
+	}
+	j["random seed"] = base_seed;
+
+	// the films run on the worker threads, so they use the single threaded dynamics world and the process wide task scheduler is
+	// not touched.
+	j["headless"] = true;
+	j["visualize"] = false;
+	j["multithreaded dynamics world"] = false;
+
+	deposition_properties p = read_deposition_properties(j);
+	if ((p.target_number_of_saved_tubes <= 0) and (p.target_film_height <= 0)) {
+		throw std::invalid_argument("the films of an ensemble need a target number of saved tubes or a target film height.");
+	}
+
+	// this object only prepares the output directory of the ensemble and owns the shared collision shapes, it has no world
+	DummyGUIHelper shape_gui;
+	cnt_mesh* shape_owner = new cnt_mesh(&shape_gui, j);
+	shape_owner->parse_json_prop(resume);
+	if (not resume) {
+		shape_owner->save_json_properties(j);
+	}
+	shape_owner->create_tube_colShapes();
+
+	std::cout << "running an ensemble of " << ensemble_size << " films on " << number_of_workers << " threads" << std::endl;
+
+	// gDeactivationTime is a global of bullet that the films read while they step, so it is set once before any film starts. the films
+	// only check in initPhysics that it has their value.
+	gDeactivationTime = float(j["deactivation time [s]"]);
+
+	// the setup of a film prints a lot, so only one film is set up or torn down at a time. the films are stepped in parallel.
+	std::mutex setup_mutex;
+	std::atomic<int> next_film(0);
+
+	auto worker = [&]() {
+		for (int i=next_film++; i<ensemble_size; i=next_film++) {
+			// a stopped run does not start any new films
+			if (stop_signal or ((p.wall_clock_budget > 0) and (run_wall_time() >= p.wall_clock_budget)))
+				break;
+
+			long long seed = base_seed + i;
+			nlohmann::json film_prop = j;
+			film_prop["random seed"] = seed;
+			fs::path film_directory = shape_owner->output_directory() / ("seed_"+std::to_string(seed));
+			film_prop["output directory"] = film_directory.string();
+			film_prop["keep old files"] = false;
+			bool film_resume = resume and fs::exists(film_directory / "checkpoint.cbor");
+
+			DummyGUIHelper gui;
+			cnt_mesh* film = new cnt_mesh(&gui, film_prop);
+			{
+				std::lock_guard<std::mutex> lock(setup_mutex);
+				film->parse_json_prop(film_resume);
+				if (not film_resume) {
+					film->save_json_properties(film_prop);
+				}
+				film->initPhysics();
+				film->create_container();
+				film->share_tube_colShapes(*shape_owner);
+				if (film_resume) {
+					film->load_checkpoint();
+				}
+			}
+
+			deposition_summary summary = deposit_film(film, p, false, [](){});
+
+			std::lock_guard<std::mutex> lock(setup_mutex);
+			std::cout << "film " << i << " (seed " << seed << ") is done,  height [nm]: " << film->read_film_height() << ",  simulation steps: " << film->number_of_substeps()
+			          << ",  mean step time [ms]: " << 1000*film->mean_step_time() << ",  packing density: " << film->packing_density() << std::endl;
+			print_throughput(summary);
+			film->exitPhysics();
+			delete film;
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (int t=0; t<number_of_workers; ++t) {
+		workers.emplace_back(worker);
+	}
+	for (auto& w: workers) {
+		w.join();
+	}
+
+	shape_owner->exitPhysics();
+	delete shape_owner;
+}
+
 int main(int argc, char* argv[]) {
 
 	// print the start time and start recording the run time
@@ -55,112 +346,112 @@ int main(int argc, char* argv[]) {
 	std::cout << std::endl << "start time:" << std::endl << std::asctime(std::localtime(&start_time)) << std::endl;
 
 
-	// get the input JSON filename
-	std::string filename;
-	if (argc <= 1){
-		filename = "input.json";
-	} else {
-		filename = argv[1];
+	// get the input JSON filename. with --resume the run continues from the checkpoint in its output directory.
+	std::string filename = "input.json";
+	bool resume = false;
+	for (int i=1; i<argc; ++i) {
+		if (std::string(argv[i]) == "--resume") {
+			resume = true;
+		} else {
+			filename = argv[i];
+		}
 	}
 
 	// read the input JSON file
 	std::ifstream input_file(filename.c_str());
 	nlohmann::json j;
 	input_file >> j;	
-	
-	int number_of_tubes_added_together = j["number of tubes added together"];
-	int number_of_active_tubes = j["number of active tubes"];
-	int number_of_tubes_before_deletion = j["number of tubes before deletion"];
-	int number_of_unsaved_tubes = j["number of unsaved tubes"];
 
+	// stop the films cleanly on ctrl-c or when the batch scheduler ends the job
+	std::signal(SIGINT, handle_stop_signal);
+	std::signal(SIGTERM, handle_stop_signal);
 
+	// many small films with different seeds are run together in one process
+	if (int(j["ensemble size"]) > 1) {
+		run_ensemble(j, resume);
+
+		std::time_t end_time = std::time(nullptr);
+		std::cout << std::endl << "end time:" << std::endl << std::asctime(std::localtime(&end_time));
+		std::cout << "runtime: " << std::difftime(end_time,start_time) << " seconds" << std::endl << std::endl;
+		return 0;
+	}
+	
+	deposition_properties p = read_deposition_properties(j);
 
-	SimpleOpenGL3App* app;
+	SimpleOpenGL3App* app = nullptr;
 	GUIHelperInterface* gui;
 
 	// flag to let the graphic visualization happen
 	bool visualize = j["visualize"];
-	
-	// SimpleOpenGL3App is a child of CommonGraphicsApp virtual class.
-	app = new SimpleOpenGL3App("carbon nanotube mesh",1024,768,true);
 
-	prevMouseButtonCallback = app->m_window->getMouseButtonCallback();
-	prevMouseMoveCallback = app->m_window->getMouseMoveCallback();
+	// flag to run without any window or OpenGL context (e.g. on compute nodes without an X server).
+	// in this mode a no-op gui helper is used and nothing is ever rendered.
+	bool headless = j["headless"];
+	if (headless) {
+		visualize = false;
+	}
 
-	app->m_window->setMouseButtonCallback((b3MouseButtonCallback)OnMouseDown);
-	app->m_window->setMouseMoveCallback((b3MouseMoveCallback)OnMouseMove);
-	
-	gui = new OpenGLGuiHelper(app,false); // the second argument is a dummy one
-	// gui = new DummyGUIHelper();
+	if (headless) {
+		gui = new DummyGUIHelper();
+		std::cout << "running in headless mode!" << std::endl;
+	} else {
+		// SimpleOpenGL3App is a child of CommonGraphicsApp virtual class.
+		app = new SimpleOpenGL3App("carbon nanotube mesh",1024,768,true);
+
+		prevMouseButtonCallback = app->m_window->getMouseButtonCallback();
+		prevMouseMoveCallback = app->m_window->getMouseMoveCallback();
+
+		app->m_window->setMouseButtonCallback((b3MouseButtonCallback)OnMouseDown);
+		app->m_window->setMouseMoveCallback((b3MouseMoveCallback)OnMouseMove);
+		
+		gui = new OpenGLGuiHelper(app,false); // the second argument is a dummy one
+	}
 
 	CommonExampleOptions options(gui);
 
 	// CommonExampleInterface* example;
 	example = new cnt_mesh(options.m_guiHelper, j);
 	
-	example->parse_json_prop();
-	example->save_json_properties(j);
+	example->parse_json_prop(resume);
+	if (not resume) {
+		example->save_json_properties(j);
+	}
+
+	// gDeactivationTime is a global of bullet, which is set here and only checked by the film
+	gDeactivationTime = float(j["deactivation time [s]"]);
 
 
 	example->initPhysics();
 	example->create_container(); //container size is set in input.json
 	example->create_tube_colShapes();
+	if (resume) {
+		example->load_checkpoint();
+	}
 
 	if (visualize) {
 		example->resetCamera();
 	}
 	
-	int step_number = 0;
-
-
-	// example->get_Ly();
-	// example->add_tube_in_xz();
-
-
-	while(true)
-	{
-		step_number ++;
-	
-		btScalar dtSec = 0.05;
-		// btScalar dtSec = 0.01;
-		example->stepSimulation(dtSec);
-
-		if (step_number % 50 == 0) // add new tubes every couple of steps.
-		{	
-			example->get_Ly();
-
-			// add this many cnt's at a time
-			for (int i=0; i<number_of_tubes_added_together; i++)
-			{
-				example->add_tube_in_xz();
-			}
-			example->save_tubes(number_of_unsaved_tubes);
-			example->freeze_tubes(number_of_active_tubes); // keep only this many of tubes active (for example 100) and freeze the rest of the tubes
-			// example->remove_tubes(number_of_tubes_before_deletion); // keep only this many of tubes in the simulation (for example 400) and delete the rest of objects
+	deposition_summary summary = deposit_film(example, p, true, [&]() {
+		if (visualize)
+		{
+			app->m_instancingRenderer->init();
+			app->m_instancingRenderer->updateCamera(app->getUpAxis());
+			example->renderScene();
 			
-			std::cout << "number of saved tubes: " << example->no_of_saved_tubes() << ",  height [nm]:" << example->read_Ly() << "      \r" << std::flush;
+			// draw some grids in the space
+			DrawGridData dg;
+			dg.upAxis = app->getUpAxis();
+			app->drawGrid(dg);
 			
-			if (visualize)
-			{
-				app->m_instancingRenderer->init();
-				app->m_instancingRenderer->updateCamera(app->getUpAxis());
-				example->renderScene();
-				
-				// draw some grids in the space
-				DrawGridData dg;
-				dg.upAxis = app->getUpAxis();
-				app->drawGrid(dg);
-				
-				app->swapBuffer();
+			app->swapBuffer();
 
-			}
 		}
-
-	}
+	});
 
 
-	// if we did not visualize the simulation all along now visualize it one last time.
-	if (not visualize)
+	// if we did not visualize the simulation all along now visualize it one last time (there is nothing to draw on in headless mode).
+	if ((not visualize) and (not headless))
 	{
 		example->resetCamera();
 		app->m_instancingRenderer->init();
@@ -180,12 +471,21 @@ int main(int argc, char* argv[]) {
 	std::clock_t end = std::clock();
 	std::time_t end_time = std::time(nullptr);
 	std::cout << std::endl << "end time:" << std::endl << std::asctime(std::localtime(&end_time));
-	std::cout << "runtime: " << std::difftime(end_time,start_time) << " seconds" << std::endl << std::endl;
+	std::cout << "runtime: " << std::difftime(end_time,start_time) << " seconds" << std::endl;
+	std::cout << "simulation steps: " << example->number_of_substeps() << ",  simulated time [s]: " << example->simulated_time() << std::endl;
+	std::cout << "mean step time [ms]: " << 1000*example->mean_step_time() << ",  mean broadphase time [ms]: " << 1000*example->mean_broadphase_time()
+	          << ",  overlapping pairs: " << example->number_of_overlapping_pairs() << ",  packing density: " << example->packing_density() << std::endl;
+	print_throughput(summary);
+	std::cout << std::endl;
 	
-	std::cin.ignore();
+	// keep the window open until the user presses enter. in headless mode (or after a stop signal) just exit.
+	if ((not headless) and (not stop_signal)) {
+		std::cin.ignore();
+	}
 
 	example->exitPhysics();
 	delete example;
+	delete gui;
 	delete app;
 
 
@@ -0,0 +1,249 @@
+#include <iostream>
+#include <algorithm>
+
+#include "uniform_grid_broadphase.h"
+
+uniform_grid_broadphase::uniform_grid_broadphase(float cell_size, int max_cells_per_proxy, btOverlappingPairCache* pair_cache) {
+  _cell_size = cell_size;
+  _max_cells_per_proxy = max_cells_per_proxy;
+
+  _owns_pair_cache = (pair_cache == nullptr);
+  if (_owns_pair_cache) {
+    void* memory = btAlignedAlloc(sizeof(btHashedOverlappingPairCache), 16);
+    pair_cache = new (memory) btHashedOverlappingPairCache();
+  }
+  _pair_cache = pair_cache;
+}
+
+uniform_grid_broadphase::~uniform_grid_broadphase() {
+  for (auto& proxy: _proxies) {
+    _proxy_pool.destroy(proxy);
+  }
+
+  if (_owns_pair_cache) {
+    _pair_cache->~btOverlappingPairCache();
+    btAlignedFree(_pair_cache);
+  }
+}
+
+// put the proxy in the cells that its aabb covers. the number of cells is checked in floating point first, because the aabb of the
+// ground plane is too large for the cell indices.
+void uniform_grid_broadphase::insert(grid_proxy* proxy) {
+  double number_of_cells = 1;
+  for (int k=0; k<3; ++k) {
+    number_of_cells *= std::floor(proxy->m_aabbMax[k]/_cell_size) - std::floor(proxy->m_aabbMin[k]/_cell_size) + 1;
+  }
+
+  if (number_of_cells > _max_cells_per_proxy) {
+    proxy->large = true;
+    _large_proxies.push_back(proxy);
+    return;
+  }
+
+  proxy->large = false;
+  for (int k=0; k<3; ++k) {
+    proxy->cell_min[k] = cell_index(proxy->m_aabbMin[k]);
+    proxy->cell_max[k] = cell_index(proxy->m_aabbMax[k]);
+  }
+
+  for (int ix=proxy->cell_min[0]; ix<=proxy->cell_max[0]; ++ix) {
+    for (int iy=proxy->cell_min[1]; iy<=proxy->cell_max[1]; ++iy) {
+      for (int iz=proxy->cell_min[2]; iz<=proxy->cell_max[2]; ++iz) {
+        _cells[cell_key(ix,iy,iz)].push_back(proxy);
+      }
+    }
+  }
+}
+
+// take the proxy out of its cells. the cells only hold a few proxies, so they are searched linearly. empty cells are dropped.
+void uniform_grid_broadphase::remove(grid_proxy* proxy) {
+  if (proxy->large) {
+    _large_proxies.erase(std::find(_large_proxies.begin(), _large_proxies.end(), proxy));
+    return;
+  }
+
+  for (int ix=proxy->cell_min[0]; ix<=proxy->cell_max[0]; ++ix) {
+    for (int iy=proxy->cell_min[1]; iy<=proxy->cell_max[1]; ++iy) {
+      for (int iz=proxy->cell_min[2]; iz<=proxy->cell_max[2]; ++iz) {
+        auto it = _cells.find(cell_key(ix,iy,iz));
+        std::vector<grid_proxy*>& cell = it->second;
+        auto pit = std::find(cell.begin(), cell.end(), proxy);
+        *pit = cell.back();
+        cell.pop_back();
+        if (cell.empty())
+          _cells.erase(it);
+      }
+    }
+  }
+}
+
+template <class Callback>
+void uniform_grid_broadphase::query(const btVector3& aabbMin, const btVector3& aabbMax, Callback process) {
+  _query_stamp++;
+
+  auto visit = [&](grid_proxy* proxy) {
+    if (proxy->query_stamp == _query_stamp)
+      return;
+    proxy->query_stamp = _query_stamp;
+    if (TestAabbAgainstAabb2(aabbMin, aabbMax, proxy->m_aabbMin, proxy->m_aabbMax))
+      process(proxy);
+  };
+
+  for (auto& proxy: _large_proxies) {
+    visit(proxy);
+  }
+
+  // a box that covers too many cells is answered by walking all the proxies
+  double number_of_cells = 1;
+  for (int k=0; k<3; ++k) {
+    number_of_cells *= std::floor(aabbMax[k]/_cell_size) - std::floor(aabbMin[k]/_cell_size) + 1;
+  }
+  if (number_of_cells > _max_cells_per_proxy) {
+    for (auto& proxy: _proxies) {
+      visit(proxy);
+    }
+    return;
+  }
+
+  for (int ix=cell_index(aabbMin[0]); ix<=cell_index(aabbMax[0]); ++ix) {
+    for (int iy=cell_index(aabbMin[1]); iy<=cell_index(aabbMax[1]); ++iy) {
+      for (int iz=cell_index(aabbMin[2]); iz<=cell_index(aabbMax[2]); ++iz) {
+        auto it = _cells.find(cell_key(ix,iy,iz));
+        if (it == _cells.end())
+          continue;
+        for (auto& proxy: it->second) {
+          visit(proxy);
+        }
+      }
+    }
+  }
+}
+
+btBroadphaseProxy* uniform_grid_broadphase::createProxy(const btVector3& aabbMin, const btVector3& aabbMax, int shapeType, void* userPtr, int collisionFilterGroup, int collisionFilterMask, btDispatcher* dispatcher) {
+  (void)shapeType;
+  (void)dispatcher;
+
+  grid_proxy* proxy = _proxy_pool.create(aabbMin, aabbMax, userPtr, collisionFilterGroup, collisionFilterMask);
+  proxy->m_uniqueId = _next_uid++;
+  proxy->index = _proxies.size();
+  _proxies.push_back(proxy);
+
+  insert(proxy);
+
+  // a new proxy finds its pairs in the next call to calculateOverlappingPairs
+  proxy->moved = true;
+  _moved_proxies.push_back(proxy);
+
+  return proxy;
+}
+
+void uniform_grid_broadphase::destroyProxy(btBroadphaseProxy* absproxy, btDispatcher* dispatcher) {
+  grid_proxy* proxy = static_cast<grid_proxy*>(absproxy);
+
+  remove(proxy);
+  _pair_cache->removeOverlappingPairsContainingProxy(proxy, dispatcher);
+
+  if (proxy->moved)
+    _moved_proxies.erase(std::find(_moved_proxies.begin(), _moved_proxies.end(), proxy));
+
+  _proxies[proxy->index] = _proxies.back();
+  _proxies[proxy->index]->index = proxy->index;
+  _proxies.pop_back();
+
+  _proxy_pool.destroy(proxy);
+}
+
+// move the proxy to the cells of its new aabb. the cells only change when the aabb crosses a cell boundary.
+void uniform_grid_broadphase::setAabb(btBroadphaseProxy* absproxy, const btVector3& aabbMin, const btVector3& aabbMax, btDispatcher* dispatcher) {
+  (void)dispatcher;
+  grid_proxy* proxy = static_cast<grid_proxy*>(absproxy);
+
+  if ((proxy->m_aabbMin == aabbMin) and (proxy->m_aabbMax == aabbMax))
+    return;
+
+  bool same_cells = not proxy->large;
+  for (int k=0; same_cells and (k<3); ++k) {
+    same_cells = (cell_index(aabbMin[k]) == proxy->cell_min[k]) and (cell_index(aabbMax[k]) == proxy->cell_max[k]);
+  }
+
+  if (not same_cells)
+    remove(proxy);
+  proxy->m_aabbMin = aabbMin;
+  proxy->m_aabbMax = aabbMax;
+  if (not same_cells)
+    insert(proxy);
+
+  if (not proxy->moved) {
+    proxy->moved = true;
+    _moved_proxies.push_back(proxy);
+  }
+}
+
+void uniform_grid_broadphase::getAabb(btBroadphaseProxy* proxy, btVector3& aabbMin, btVector3& aabbMax) const {
+  aabbMin = proxy->m_aabbMin;
+  aabbMax = proxy->m_aabbMax;
+}
+
+// only the proxies in the cells along the box that is swept by the ray (or by the shape in a convex sweep) are given to the callback
+void uniform_grid_broadphase::rayTest(const btVector3& rayFrom, const btVector3& rayTo, btBroadphaseRayCallback& rayCallback, const btVector3& aabbMin, const btVector3& aabbMax) {
+  btVector3 sweep_min = rayFrom;
+  btVector3 sweep_max = rayFrom;
+  sweep_min.setMin(rayTo);
+  sweep_max.setMax(rayTo);
+
+  query(sweep_min+aabbMin, sweep_max+aabbMax, [&](grid_proxy* proxy) {
+    rayCallback.process(proxy);
+  });
+}
+
+void uniform_grid_broadphase::aabbTest(const btVector3& aabbMin, const btVector3& aabbMax, btBroadphaseAabbCallback& callback) {
+  query(aabbMin, aabbMax, [&](grid_proxy* proxy) {
+    callback.process(proxy);
+  });
+}
+
+// removes the pairs whose aabbs do not overlap anymore
+struct remove_separated_pairs_callback : public btOverlapCallback
+{
+  bool processOverlap(btBroadphasePair& pair) override
+  {
+    return not TestAabbAgainstAabb2(pair.m_pProxy0->m_aabbMin, pair.m_pProxy0->m_aabbMax, pair.m_pProxy1->m_aabbMin, pair.m_pProxy1->m_aabbMax);
+  };
+};
+
+void uniform_grid_broadphase::calculateOverlappingPairs(btDispatcher* dispatcher) {
+  if (_moved_proxies.empty())
+    return;
+
+  // a pair can only stop overlapping when one of its proxies moved, so one pass over the pair cache after the moves removes all the
+  // pairs that are separated
+  remove_separated_pairs_callback remove_callback;
+  _pair_cache->processAllOverlappingPairs(&remove_callback, dispatcher);
+
+  // find the new pairs of the moved proxies. a pair of two moved proxies is only added by the one with the smaller uid.
+  for (auto& proxy: _moved_proxies) {
+    query(proxy->m_aabbMin, proxy->m_aabbMax, [&](grid_proxy* other) {
+      if (other == proxy)
+        return;
+      if (other->moved and (other->m_uniqueId < proxy->m_uniqueId))
+        return;
+      if (_pair_cache->findPair(proxy, other) == nullptr)
+        _pair_cache->addOverlappingPair(proxy, other);
+    });
+  }
+
+  for (auto& proxy: _moved_proxies) {
+    proxy->moved = false;
+  }
+  _moved_proxies.clear();
+}
+
+void uniform_grid_broadphase::getBroadphaseAabb(btVector3& aabbMin, btVector3& aabbMax) const {
+  aabbMin.setValue(-BT_LARGE_FLOAT, -BT_LARGE_FLOAT, -BT_LARGE_FLOAT);
+  aabbMax.setValue(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
+}
+
+void uniform_grid_broadphase::printStats() {
+  std::cout << "uniform grid broadphase: " << _proxies.size() << " proxies, " << _large_proxies.size() << " large proxies, "
+            << _cells.size() << " cells, " << _pair_cache->getNumOverlappingPairs() << " overlapping pairs" << std::endl;
+}
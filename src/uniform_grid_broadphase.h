@@ -0,0 +1,105 @@
+#ifndef uniform_grid_broadphase_h
+#define uniform_grid_broadphase_h
+
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cmath>
+
+#include "btBulletDynamicsCommon.h"
+#include "BulletCollision/BroadphaseCollision/btBroadphaseInterface.h"
+#include "BulletCollision/BroadphaseCollision/btOverlappingPairCache.h"
+#include "LinearMath/btAabbUtil2.h"
+
+#include "./helper/object_pool.hpp"
+#include "./helper/batch_world.hpp"
+
+// broadphase that sorts the proxies into the cells of a uniform grid. the grid is a hash map of cells, so it does not need bounds
+// and the film can grow in the y direction without limit. only the proxies that moved since the last call to
+// calculateOverlappingPairs are tested against the other proxies in their cells, so the frozen tubes, which never move, cost nothing
+// per step. proxies that would cover too many cells (the ground plane, the floor heightfield, and the static blocks) are kept in a
+// separate list and are tested against every moved proxy.
+class uniform_grid_broadphase : public btBroadphaseInterface, public pair_cache_swap
+{
+	struct grid_proxy : public btBroadphaseProxy
+	{
+		int cell_min[3], cell_max[3]; // range of the cells that the aabb of the proxy covers
+		bool large=false; // the proxy covers too many cells and is in the list of large proxies
+		bool moved=false; // the aabb changed since the last call to calculateOverlappingPairs
+		int index=0; // index of the proxy in the _proxies vector
+		unsigned query_stamp=0; // number of the last query that visited this proxy, to avoid visiting it twice
+
+		grid_proxy(const btVector3& aabbMin, const btVector3& aabbMax, void* userPtr, int collisionFilterGroup, int collisionFilterMask)
+			: btBroadphaseProxy(aabbMin, aabbMax, userPtr, collisionFilterGroup, collisionFilterMask) {};
+	};
+
+	float _cell_size; // edge length of the cubic cells
+	int _max_cells_per_proxy; // proxies that cover more cells than this go into the list of large proxies
+
+	std::unordered_map<std::int64_t, std::vector<grid_proxy*>> _cells; // proxies in each cell, the key is made from the cell indices
+	std::vector<grid_proxy*> _proxies; // all the proxies
+	std::vector<grid_proxy*> _large_proxies; // proxies that are not put in the cells
+	std::vector<grid_proxy*> _moved_proxies; // proxies whose aabb changed since the last call to calculateOverlappingPairs
+
+	object_pool<grid_proxy> _proxy_pool;
+	int _next_uid=1;
+	unsigned _query_stamp=0;
+
+	btOverlappingPairCache* _pair_cache;
+	bool _owns_pair_cache;
+
+	// index of the cell that contains the coordinate x along one axis
+	inline int cell_index(btScalar x) const {
+		return int(std::floor(x/_cell_size));
+	};
+
+	// key of a cell in the hash map
+	inline std::int64_t cell_key(int ix, int iy, int iz) const {
+		const std::int64_t offset = 1<<20;
+		return ((std::int64_t(ix)+offset)<<42) | ((std::int64_t(iy)+offset)<<21) | (std::int64_t(iz)+offset);
+	};
+
+	// put the proxy in the cells that its aabb covers, or in the list of large proxies
+	void insert(grid_proxy* proxy);
+
+	// take the proxy out of its cells, or out of the list of large proxies
+	void remove(grid_proxy* proxy);
+
+	// call process for every proxy whose aabb overlaps the given box, each proxy is visited once
+	template <class Callback>
+	void query(const btVector3& aabbMin, const btVector3& aabbMax, Callback process);
+
+public:
+	uniform_grid_broadphase(float cell_size, int max_cells_per_proxy=4096, btOverlappingPairCache* pair_cache=nullptr);
+	virtual ~uniform_grid_broadphase();
+
+	btBroadphaseProxy* createProxy(const btVector3& aabbMin, const btVector3& aabbMax, int shapeType, void* userPtr, int collisionFilterGroup, int collisionFilterMask, btDispatcher* dispatcher) override;
+	void destroyProxy(btBroadphaseProxy* proxy, btDispatcher* dispatcher) override;
+	void setAabb(btBroadphaseProxy* proxy, const btVector3& aabbMin, const btVector3& aabbMax, btDispatcher* dispatcher) override;
+	void getAabb(btBroadphaseProxy* proxy, btVector3& aabbMin, btVector3& aabbMax) const override;
+
+	void rayTest(const btVector3& rayFrom, const btVector3& rayTo, btBroadphaseRayCallback& rayCallback, const btVector3& aabbMin=btVector3(0,0,0), const btVector3& aabbMax=btVector3(0,0,0)) override;
+	void aabbTest(const btVector3& aabbMin, const btVector3& aabbMax, btBroadphaseAabbCallback& callback) override;
+
+	// add the pairs of the moved proxies that start to overlap and remove the pairs that stop overlapping
+	void calculateOverlappingPairs(btDispatcher* dispatcher) override;
+
+	btOverlappingPairCache* getOverlappingPairCache() override {
+		return _pair_cache;
+	};
+	const btOverlappingPairCache* getOverlappingPairCache() const override {
+		return _pair_cache;
+	};
+
+	// the pair cache is swapped out while batch_world destroys the proxies of a batch of objects
+	btOverlappingPairCache* swap_pair_cache(btOverlappingPairCache* pair_cache) override {
+		std::swap(_pair_cache, pair_cache);
+		return pair_cache;
+	};
+
+	void getBroadphaseAabb(btVector3& aabbMin, btVector3& aabbMax) const override;
+
+	void printStats() override;
+};
+
+#endif //uniform_grid_broadphase_h